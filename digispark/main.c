@@ -97,6 +97,14 @@ int usbDescriptorStringSerialNumber[] = {
 #define CMD_I2C_IO     4
 #define CMD_I2C_BEGIN  1  // flag fo I2C_IO
 #define CMD_I2C_END    2  // flag fo I2C_IO
+#define CMD_I2C_STATUS 8  // flag fo I2C_IO, append status to IN transfers
+
+#define CMD_GET_FEATURES 16
+#define CMD_SET_STRETCH  23
+
+/* protocol extensions reported by CMD_GET_FEATURES */
+#define FEATURE_INLINE_STATUS  0x00000001
+#define FEATURE_STRETCH        0x00000100
 
 /* linux kernel flags */
 #define I2C_M_TEN		0x10	/* we have a ten bit chip address */
@@ -156,6 +164,9 @@ int usbDescriptorStringSerialNumber[] = {
 /* the currently support capability is quite limited */
 const unsigned long func PROGMEM = I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
 
+const unsigned long features PROGMEM = FEATURE_INLINE_STATUS |
+  FEATURE_STRETCH;
+
 #define LED_DDR DDRB
 #define LED_PIN PINB
 #define LED_PORT PORTB
@@ -172,19 +183,287 @@ const unsigned long func PROGMEM = I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
 #define I2C_SDA _BV(0)
 #define I2C_SCL _BV(2)
 
-/* Scoped, this delay offset gives 102kHz. Close enough. */
-#define DELAY_OVERHEAD 7UL
+#define DEFAULT_DELAY 10  // default 10us (100khz)
+
+#define I2C_IS_AN_OPEN_COLLECTOR_BUS
+
+#if defined(I2C_FAST) && (!defined(ENABLE_SCL_EXPAND) || \
+			  !defined(I2C_IS_AN_OPEN_COLLECTOR_BUS))
+#error "I2C_FAST requires ENABLE_SCL_EXPAND and an open collector bus"
+#endif
+
+#define CLOCK_CYCLES(us) ((F_CPU/1000UL)*(us)/1000UL)
+
+#ifdef I2C_USI
+/* The USI shifts the bits in hardware, the cpu only strobes the clock. */
+/* Timer0 runs at the cpu clock or a fraction of it and paces the scl */
+/* phases: 3/5 of each bit low and 2/5 high which meets the minimum */
+/* low and high times of both 100kHz and 400kHz mode. */
+#define USI_CLOCK  (_BV(USIWM1) | _BV(USICS1) | _BV(USICLK) | _BV(USITC))
+#define USI_8BIT   (_BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC))
+#define USI_1BIT   (USI_8BIT | (0x0e << USICNT0))
+
+/* cpu cycles per scl phase spent outside the timer wait */
+#ifndef USI_OVERHEAD
+#define USI_OVERHEAD 6
+#endif
+
+static uchar usi_lo, usi_hi;   // timer0 ticks of the scl low and high phase
 
-/* Scale up the delay to match 12MHz -> 16.5MHz clock */
-#define DEFAULT_DELAY (((10UL * 1650UL + 60UL) / 1200UL) - DELAY_OVERHEAD)
+#if defined(I2C_FAST)
+#error "I2C_FAST and I2C_USI cannot be combined"
+#endif
+#else
+/* The delay function used delays 4 system ticks per cycle. It is */
+/* called twice per clock edge, once with the full delay and once */
+/* with the half one, so one bit takes 8 * (clock_delay + clock_delay2) */
+/* cycles plus the overhead of the surrounding code. Scoped, that */
+/* overhead is about 90 cycles per bit with the SCL read back for */
+/* clock stretching. Without ENABLE_SCL_EXPAND SCL isn't touched at */
+/* all, which saves the 2 cycles of each DDR update and the 3 of the */
+/* read back. */
+#ifndef I2C_BIT_OVERHEAD
+#ifdef ENABLE_SCL_EXPAND
+#define I2C_BIT_OVERHEAD 90UL
+#else
+#define I2C_BIT_OVERHEAD 83UL
+#endif
+#endif
+
+#define CLOCK_LOOPS(us)  ((CLOCK_CYCLES(us) > I2C_BIT_OVERHEAD + 24)? \
+			  (CLOCK_CYCLES(us) - I2C_BIT_OVERHEAD)/8 : 3)
+#define CLOCK_DELAY2(us) (CLOCK_LOOPS(us)/3)
+#define CLOCK_DELAY(us)  (CLOCK_LOOPS(us) - CLOCK_DELAY2(us))
+
+/* The shortest loop count adds 24 cycles to the overhead, shorter */
+/* periods can't be reached. At 16.5MHz that is 7us or about 143kHz. */
+#define CLOCK_MIN_DELAY  (((I2C_BIT_OVERHEAD + 24)*1000000UL + F_CPU - 1)/F_CPU)
+
+/* loop counts for 1 to 16us, calculated for F_CPU at build time */
+#define CLOCK_TABLE_SIZE 16
+static const uchar clock_table[CLOCK_TABLE_SIZE] PROGMEM = {
+  CLOCK_LOOPS(1),  CLOCK_LOOPS(2),  CLOCK_LOOPS(3),  CLOCK_LOOPS(4),
+  CLOCK_LOOPS(5),  CLOCK_LOOPS(6),  CLOCK_LOOPS(7),  CLOCK_LOOPS(8),
+  CLOCK_LOOPS(9),  CLOCK_LOOPS(10), CLOCK_LOOPS(11), CLOCK_LOOPS(12),
+  CLOCK_LOOPS(13), CLOCK_LOOPS(14), CLOCK_LOOPS(15), CLOCK_LOOPS(16)
+};
+
+static uint16_t clock_delay = CLOCK_DELAY(DEFAULT_DELAY);
+static uint16_t clock_delay2 = CLOCK_DELAY2(DEFAULT_DELAY);
+#endif
 
-static uint16_t clock_delay = DEFAULT_DELAY;
-static uint16_t clock_delay2 = DEFAULT_DELAY / 2;
+#ifdef I2C_FAST
+/* Hand timed 400kHz byte transfers from i2cfast.S are used for delays */
+/* of 2us and below. */
+#define I2C_FAST_DELAY 2
+
+extern uchar i2c_fast_put_u08(uchar b);
+extern uchar i2c_fast_get_u08(uchar last);
+
+static uchar clock_fast = 0;
+#endif
 
 static uint16_t expected = 0;
 static unsigned char saved_cmd;
 
-#define I2C_IS_AN_OPEN_COLLECTOR_BUS
+/* A client may hold SCL low to slow down the transfer. The wait for it */
+/* is bounded by stretch_ticks of timer 0 running at F_CPU/1024, once a */
+/* client held it longer all waits end at once until the next start     */
+/* condition and the message fails with STATUS_TIMEOUT. Both variables  */
+/* are shared with i2cfast.S.                                           */
+#define TIMER_CS         (_BV(CS02) | _BV(CS00))
+#define TIMER_TICKS(ms)  ((F_CPU/1024UL)*(ms)/1000UL)
+
+#define DEFAULT_STRETCH  25   // ms
+#define MAX_STRETCH      250  // ms, well below the watchdog timeout
+
+uint16_t stretch_ticks = TIMER_TICKS(DEFAULT_STRETCH);
+uchar i2c_stretched;
+
+static void i2c_set_stretch(uint16_t ms) {
+  if(ms > MAX_STRETCH) ms = MAX_STRETCH;
+
+  stretch_ticks = TIMER_TICKS(ms);
+  if(!stretch_ticks) stretch_ticks = 1;
+}
+
+/* wait while a client holds SCL low, but not forever */
+static void i2c_wait_scl(void) {
+  uint16_t ticks = 0;
+  uchar last = TCNT0, now;
+
+  while(!(I2C_PIN & I2C_SCL) && !i2c_stretched) {
+    now = TCNT0;
+    ticks += (uchar)(now - last);
+    last = now;
+
+    if(ticks > stretch_ticks)
+      i2c_stretched = 1;
+  }
+}
+
+#ifdef I2C_USI
+/* set the scl phase lengths for a clock period of delay us */
+static void i2c_set_clock(uint16_t delay) {
+  uint32_t cycles = CLOCK_CYCLES(delay?delay:1);
+  uchar cs = _BV(CS00);                    // clk/1
+
+  if(cycles > 425) { cycles /= 8; cs = _BV(CS01); }
+  if(cycles > 425) { cycles /= 8; cs = _BV(CS01) | _BV(CS00); }
+  if(cycles > 425) cycles = 425;
+
+  usi_hi = cycles*2/5;
+  usi_lo = cycles - usi_hi;
+
+  /* at full speed the code between the waits counts as well */
+  if(cs == _BV(CS00)) {
+    usi_hi = (usi_hi > USI_OVERHEAD)?usi_hi - USI_OVERHEAD:1;
+    usi_lo = (usi_lo > USI_OVERHEAD)?usi_lo - USI_OVERHEAD:1;
+  }
+
+  TCCR0B = cs;
+}
+
+/* wait until ticks have passed since the last scl edge */
+static void usi_wait(uchar ticks) {
+  while(TCNT0 < ticks);
+}
+
+/* the stretch timeout is measured with timer0 switched to the slow */
+/* prescaler, the scl phase restarts afterwards */
+static void usi_wait_scl(void) {
+  if(!(I2C_PIN & I2C_SCL)) {
+    uchar cs = TCCR0B;
+
+    TCCR0B = TIMER_CS;
+    i2c_wait_scl();
+    TCCR0B = cs;
+  }
+  TCNT0 = 0;
+}
+
+/* release scl and wait while a client stretches the clock */
+static void usi_scl_high(void) {
+  I2C_PORT |= I2C_SCL;
+  usi_wait_scl();
+}
+
+/* clock the bits set up in USISR through the data register */
+static uchar usi_transfer(uchar sr) {
+  USISR = sr;
+
+  do {
+    usi_wait(usi_lo);
+    USICR = USI_CLOCK;                    // positive edge
+    usi_wait_scl();                       // clock stretching
+    usi_wait(usi_hi);
+    USICR = USI_CLOCK;                    // negative edge
+    TCNT0 = 0;
+  } while(!(USISR & _BV(USIOIF)));
+
+  sr = USIDR;
+  USIDR = 0xff;                           // release SDA
+  return sr;
+}
+
+static void i2c_init(void) {
+  /* the USI drives the open collector outputs, the pins are released */
+  /* as long as the port and the data register bits are set */
+  I2C_PORT |= I2C_SDA | I2C_SCL;
+  I2C_DDR |= I2C_SDA | I2C_SCL;
+
+  USIDR = 0xff;
+  USICR = _BV(USIWM1) | _BV(USICS1) | _BV(USICLK);
+  USISR = USI_8BIT;
+
+  /* timer0 counts freely, it's reset on every scl edge */
+  TCCR0A = 0;
+  i2c_set_clock(DEFAULT_DELAY);
+
+  /* no bytes to be expected */
+  expected = 0;
+}
+
+/* i2c start condition */
+static void i2c_start(void) {
+  i2c_stretched = 0;
+  usi_wait(usi_hi);                       // bus free time after a stop
+  I2C_PORT &= ~I2C_SDA;
+  TCNT0 = 0;
+  usi_wait(usi_hi);                       // start hold time
+  I2C_PORT &= ~I2C_SCL;
+  TCNT0 = 0;
+  I2C_PORT |= I2C_SDA;
+}
+
+/* i2c repeated start condition */
+static void i2c_repstart(void) {
+  usi_wait(usi_lo);
+  usi_scl_high();
+  i2c_start();
+}
+
+/* i2c stop condition */
+void i2c_stop(void) {
+  I2C_PORT &= ~I2C_SDA;
+  usi_wait(usi_lo);
+  usi_scl_high();
+  usi_wait(usi_hi);
+  I2C_PORT |= I2C_SDA;
+  TCNT0 = 0;
+}
+
+uchar i2c_put_u08(uchar b) {
+  USIDR = b;
+  usi_transfer(USI_8BIT);
+
+  /* let the client drive SDA for the ACK */
+  I2C_DDR &= ~I2C_SDA;
+  b = usi_transfer(USI_1BIT);
+  I2C_DDR |= I2C_SDA;
+
+  return !(b & 1);
+}
+
+uchar i2c_get_u08(uchar last) {
+  uchar b;
+
+  I2C_DDR &= ~I2C_SDA;
+  b = usi_transfer(USI_8BIT);
+  I2C_DDR |= I2C_SDA;
+
+  /* NAK the last byte, ACK all others */
+  USIDR = last?0xff:0x00;
+  usi_transfer(USI_1BIT);
+
+  return b;
+}
+
+#else
+
+/* set the bitbang loop counts for a clock period of delay us, short */
+/* periods are limited by the code overhead */
+static void i2c_set_clock(uint16_t delay) {
+  uint32_t loops;
+
+#ifdef I2C_FAST
+  clock_fast = (delay <= I2C_FAST_DELAY);
+#endif
+
+  /* with I2C_FAST the periods between the fast transfers and */
+  /* the shortest bitbanged one run at the latter */
+  if(delay < CLOCK_MIN_DELAY) delay = CLOCK_MIN_DELAY;
+
+  if(delay <= CLOCK_TABLE_SIZE)
+    loops = pgm_read_byte(clock_table + delay - 1);
+  else {
+    loops = CLOCK_LOOPS(delay);
+    if(loops > 0xffff) loops = 0xffff;
+  }
+
+  clock_delay2 = loops/3;
+  clock_delay = loops - clock_delay2;
+}
 
 static void i2c_io_set_sda(uchar hi) {
   if(hi) {
@@ -213,8 +492,9 @@ static void i2c_io_set_scl(uchar hi) {
     I2C_PORT |= I2C_SCL;          // enable pullup
 #endif
 
-    // wait while pin is pulled low by client
-    while(!(I2C_PIN & I2C_SCL));
+    // wait while pin is pulled low by client, but not forever
+    if(!(I2C_PIN & I2C_SCL))
+      i2c_wait_scl();
   } else {
     I2C_DDR |= I2C_SCL;           // port is output
 #ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
@@ -254,6 +534,10 @@ static void i2c_init(void) {
   I2C_DDR |= I2C_SCL;             // port is output
 #endif
 
+  /* timer0 counts freely as the time base of the stretch timeout */
+  TCCR0A = 0;
+  TCCR0B = TIMER_CS;
+
   /* no bytes to be expected */
   expected = 0;
 }
@@ -266,6 +550,7 @@ static void i2c_scl_toggle(void) {
 
 /* i2c start condition */
 static void i2c_start(void) {
+  i2c_stretched = 0;
   i2c_io_set_sda(0);
   i2c_io_set_scl(0);
 }
@@ -291,6 +576,11 @@ void i2c_stop(void) {
 uchar i2c_put_u08(uchar b) {
   char i;
 
+#ifdef I2C_FAST
+  if(clock_fast)
+    return i2c_fast_put_u08(b);
+#endif
+
   for (i=7;i>=0;i--) {
     if ( b & (1<<i) )  i2c_io_set_sda(1);
     else               i2c_io_set_sda(0);
@@ -311,6 +601,11 @@ uchar i2c_get_u08(uchar last) {
   char i;
   uchar c,b = 0;
 
+#ifdef I2C_FAST
+  if(clock_fast)
+    return i2c_fast_get_u08(last);
+#endif
+
   i2c_io_set_sda(1);            // make sure pullups are activated
   i2c_io_set_scl(0);            // clock LOW
 
@@ -330,6 +625,7 @@ uchar i2c_get_u08(uchar last) {
 
   return b;                     // return received byte
 }
+#endif
 
 void i2c_scan(void) {
   uchar i = 0;
@@ -356,87 +652,230 @@ struct i2c_cmd {
 #define STATUS_IDLE          0
 #define STATUS_ADDRESS_ACK   1
 #define STATUS_ADDRESS_NAK   2
+#define STATUS_DATA_NAK      4
+#define STATUS_TIMEOUT       5
 
 static uchar status = STATUS_IDLE;
 
+/* a message that failed aborts the rest of the transaction */
+static uchar i2c_failed(void) {
+  return (status == STATUS_ADDRESS_NAK) || (status == STATUS_DATA_NAK) ||
+    (status == STATUS_TIMEOUT);
+}
 
-static uchar i2c_do(struct i2c_cmd *cmd) {
-  uchar addr;
+/* a client stretching the clock for too long fails the message as well */
+static uchar i2c_nak_status(uchar nak) {
+  return i2c_stretched?STATUS_TIMEOUT:nak;
+}
 
-  LED_PORT |= LED_BV
+/* The bus is driven by a small state machine. The usb callbacks only queue */
+/* work and collect results, i2c_poll() advances the machine by one step    */
+/* from the main loop. A packet which has to wait for the bus is held back  */
+/* by not polling the usb driver, see i2c_busy().                           */
+#define I2C_IDLE     0
+#define I2C_ADDRESS  1   // start condition and address pending
+#define I2C_DATA     2   // data moving through the read or write buffer
+
+static uchar i2c_state = I2C_IDLE;
+static uchar i2c_addr;              // address byte incl. read bit
+static uint16_t i2c_left;           // data bytes still to be transferred
+static uint16_t i2c_acked;          // data bytes written and acknowledged
+static uchar i2c_ignore_nak;        // I2C_M_IGNORE_NAK
+
+/* read data is fetched ahead of the IN packets, one chunk per packet */
+#define READ_AHEAD 8
+
+static uchar ahead_buf[READ_AHEAD];
+static uchar ahead_pos, ahead_len;
+
+/* write data is queued here and acknowledged to the host right away, */
+/* the size must be a power of two */
+#define WRITE_FIFO 32
+
+static uchar wb_buf[WRITE_FIFO];
+static uchar wb_tail, wb_fill;
+
+static void i2c_poll(void) {
+  switch(i2c_state) {
+  case I2C_ADDRESS:
+    if(saved_cmd & CMD_I2C_BEGIN) 
+      i2c_start();
+    else 
+      i2c_repstart();    
+
+    // send DEVICE address
+    if(!i2c_put_u08(i2c_addr) || i2c_stretched) {
+      DEBUGF("I2C: address error @ %x\n", i2c_addr);
+
+      status = i2c_nak_status(STATUS_ADDRESS_NAK);
+      i2c_stop();
+      i2c_state = I2C_IDLE;
+      wb_fill = 0;
+      LED_PORT &= ~LED_BV;
+      return;
+    }
 
-  DEBUGF("i2c %s at 0x%02x, len = %d\n", 
-	   (cmd->flags&I2C_M_RD)?"rd":"wr", cmd->addr, cmd->len); 
+    status = STATUS_ADDRESS_ACK;
+    i2c_state = I2C_DATA;
+    break;
 
-  /* normal 7bit address */
-  addr = ( cmd->addr << 1 );
-  if (cmd->flags & I2C_M_RD )
-    addr |= 1;
+  case I2C_DATA:
+    if(i2c_addr & 1) {
+      /* refill the read ahead buffer once it has been consumed */
+      if(ahead_pos < ahead_len)
+	return;
 
-  if(cmd->cmd & CMD_I2C_BEGIN) 
-    i2c_start();
-  else 
-    i2c_repstart();    
+      ahead_pos = ahead_len = 0;
+      while(i2c_left && (ahead_len < READ_AHEAD)) {
+	i2c_left--;
+	ahead_buf[ahead_len++] = i2c_get_u08(i2c_left == 0);
+      }
 
-  // send DEVICE address
-  if(!i2c_put_u08(addr)) {
-    DEBUGF("I2C read: address error @ %x\n", addr);
+      if(i2c_stretched) {
+	status = STATUS_TIMEOUT;
+	i2c_stop();
+	i2c_state = I2C_IDLE;
+	ahead_len = 0;
+	LED_PORT &= ~LED_BV;
+	return;
+      }
+    } else if(wb_fill) {
+      /* write the oldest byte of the fifo to the bus, the rest of the */
+      /* message is dropped once the slave refuses a byte */
+      if((!i2c_put_u08(wb_buf[wb_tail]) && !i2c_ignore_nak) ||
+	 i2c_stretched) {
+	DEBUGF("write failed after %d bytes\n", i2c_acked);
+
+	status = i2c_nak_status(STATUS_DATA_NAK);
+	i2c_stop();
+	i2c_state = I2C_IDLE;
+	wb_fill = 0;
+	LED_PORT &= ~LED_BV;
+	return;
+      }
 
-    status = STATUS_ADDRESS_NAK;
-    expected = 0;
-    i2c_stop();
-  } else {  
-    status = STATUS_ADDRESS_ACK;
-    expected = cmd->len;
-    saved_cmd = cmd->cmd;
+      i2c_acked++;
+      wb_tail = (wb_tail + 1) & (WRITE_FIFO-1);
+      wb_fill--;
+      i2c_left--;
+    }
+    break;
 
-    /* check if transfer is already done (or failed) */
-    if((cmd->cmd & CMD_I2C_END) && !expected) 
+  default:
+    return;
+  }
+
+  /* message complete, end transfer on last byte */
+  if(!i2c_left) {
+    if(saved_cmd & CMD_I2C_END)
       i2c_stop();
+
+    i2c_state = I2C_IDLE;
+    LED_PORT &= ~LED_BV;
   }
+}
 
-  /* more data to be expected? */
+/* Tells whether the usb driver has to wait. It can't NAK a packet from   */
+/* its callbacks, so the main loop holds it off instead: a packet from   */
+/* the host waits for the address of a message, OUT data for room in the */
+/* fifo and the next request until the queued writes are on the bus. The */
+/* IN packet of a read waits for its chunk of data. The driver NAKs the  */
+/* host meanwhile and runs on every pass otherwise.                      */
+extern volatile signed char usbRxLen;
 
-  LED_PORT &= ~LED_BV;
+static uchar i2c_busy(void) {
+  if(i2c_state == I2C_IDLE)
+    return 0;
 
-  return(cmd->len?0xff:0x00);
+  if(usbRxLen > 0)
+    return (i2c_state == I2C_ADDRESS) || !expected ||
+      (wb_fill > WRITE_FIFO-8);
+
+  return (i2c_state == I2C_DATA) && (i2c_addr & 1) &&
+    (ahead_pos == ahead_len);
 }
 
+static uchar i2c_do(struct i2c_cmd *cmd) {
+  DEBUGF("i2c %s at 0x%02x, len = %d\n", 
+	   (cmd->flags&I2C_M_RD)?"rd":"wr", cmd->addr, cmd->len); 
+
+  saved_cmd = cmd->cmd;
+  expected = cmd->len;
+
+  /* the last byte of an IN transfer carries the status */
+  if((cmd->cmd & CMD_I2C_STATUS) && (cmd->flags & I2C_M_RD) && expected)
+    expected--;
 
+  /* a failed message aborts the rest of the transaction */
+  if((cmd->cmd & CMD_I2C_STATUS) && !(cmd->cmd & CMD_I2C_BEGIN) &&
+     i2c_failed()) {
+    DEBUGF("transaction already failed\n");
+    goto done;
+  }
 
+  /* normal 7bit address */
+  i2c_addr = ( cmd->addr << 1 );
+  if (cmd->flags & I2C_M_RD )
+    i2c_addr |= 1;
 
+  /* the bus is accessed from the main loop, the led is lit meanwhile */
+  LED_PORT |= LED_BV;
+  i2c_left = expected;
+  i2c_acked = 0;
+  i2c_ignore_nak = (cmd->flags & I2C_M_IGNORE_NAK)?1:0;
+  i2c_state = I2C_ADDRESS;
+
+ done:
+  /* more data to be expected? */
+  return(cmd->len?0xff:0x00);
+}
 
 // ----------------------------------------------------------------------
 // Handle an IN packet.
 // ----------------------------------------------------------------------
 uchar usbFunctionRead(uchar *data, uchar len)
 {
-  uchar i;
+  uchar i, max = len;
 
   DEBUGF("read %d bytes, %d exp\n", len, expected);
 
-  if(status == STATUS_ADDRESS_ACK) {
-    if(len > expected) {
-      DEBUGF("exceeds!\n");
-      len = expected;
-    }
+  /* The driver asks for the first IN packet in the same poll as the */
+  /* setup request. The address and the first chunk of the read are  */
+  /* clocked here for it, that's two steps of the state machine.      */
+  if(ahead_pos == ahead_len) {
+    if(i2c_state == I2C_ADDRESS)
+      i2c_poll();
+    i2c_poll();
+  }
 
-    // consume bytes
-    for(i=0;i<len;i++) {
-      expected--;
-      *data = i2c_get_u08(expected == 0);
-      DEBUGF("data = %x\n", *data);
-      data++;
-    }
+  if(len > expected) {
+    DEBUGF("exceeds!\n");
+    len = expected;
+  }
 
-    // end transfer on last byte
-    if((saved_cmd & CMD_I2C_END) && !expected) 
-      i2c_stop();
+  // an unacknowledged address or a failed earlier message ends the
+  // transfer early with just the status instead of dummy data
+  if(i2c_failed())
+    len = expected = 0;
+
+  // consume bytes
+  for(i=0;i<len;i++) {
+    expected--;
+    if(ahead_pos < ahead_len)
+      *data = ahead_buf[ahead_pos++];
+    else
+      *data = 0;
+    DEBUGF("data = %x\n", *data);
+    data++;
+  }
 
-  } else {
-    DEBUGF("not in ack state\n");
-    memset(data, 0, len);
+  // append status once all data has been sent
+  if((saved_cmd & CMD_I2C_STATUS) && !expected && (len < max)) {
+    *data = status;
+    saved_cmd &= ~CMD_I2C_STATUS;
+    len++;
   }
+
   return len;
 
 }
@@ -446,36 +885,35 @@ uchar usbFunctionRead(uchar *data, uchar len)
 // ----------------------------------------------------------------------
 uchar usbFunctionWrite(uchar *data, uchar len)
 {
-  uchar i, err=0;
+  uchar i;
 
   DEBUGF("write %d bytes, %d exp\n", len, expected);
 
-  if(status == STATUS_ADDRESS_ACK) {
-    if(len > expected) {
-      DEBUGF("exceeds!\n");
-      len = expected;
-    }
+  if(len > expected) {
+    DEBUGF("exceeds!\n");
+    len = expected;
+  }
 
-    // consume bytes
+  // the main loop sends the address before the data is taken, the data
+  // stage is stalled if it isn't acknowledged or the slave refused data
+  // already
+  if(i2c_failed()) {
+    expected = 0;
+    return 0xff;
+  }
+
+  if(i2c_state != I2C_IDLE) {
+    // queue bytes, the main loop only polls the driver while there's
+    // room for a packet
     for(i=0;i<len;i++) {
       expected--;
       DEBUGF("data = %x\n", *data);
-      if(!i2c_put_u08(*data++))
-	err = 1;
-    }
-
-    // end transfer on last byte
-    if((saved_cmd & CMD_I2C_END) && !expected) 
-      i2c_stop();
-
-    if(err) {
-      DEBUGF("write failed\n");
-      //TODO: set status
+      wb_buf[(wb_tail + wb_fill++) & (WRITE_FIFO-1)] = *data++;
     }
 
   } else {
     DEBUGF("not in ack state\n");
-    memset(data, 0, len);
+    expected -= len;
   }
 
   return len;
@@ -491,6 +929,14 @@ uchar	usbFunctionSetup(uchar data[8])
   usbMsgPtr = replyBuf;
   DEBUGF("Setup %x %x %x %x\n", data[0], data[1], data[2], data[3]);
 
+  /* A request is only taken once queued writes are on the bus, so */
+  /* GET_STATUS reports their result. A new request ends any message */
+  /* in progress. */
+  i2c_state = I2C_IDLE;
+  ahead_pos = ahead_len = 0;
+  wb_fill = 0;
+  LED_PORT &= ~LED_BV;
+
   switch(data[1]) {
 
   case CMD_ECHO: // echo (for transfer reliability testing)
@@ -505,44 +951,41 @@ uchar	usbFunctionSetup(uchar data[8])
     break;
 
   case CMD_SET_DELAY:
-    /* The original device used a 12MHz clock: */
-    /* --- */
-    /* The delay function used delays 4 system ticks per cycle. */
-    /* This gives 1/3us at 12Mhz per cycle. The delay function is */
-    /* called twice per clock edge and thus four times per full cycle. */ 
-    /* Thus it is called one time per edge with the full delay */ 
-    /* value and one time with the half one. Resulting in */
-    /* 2 * n * 1/3 + 2 * 1/2 n * 1/3 = n us. */
-    /* --- */
-    /* On littleWire-like devices, we run at 16.5MHz, so delay must be scaled up. */
-    { 
-      uint32_t delay = *(unsigned short*)(data+2);
-      delay = (delay*1650UL + 600UL) / 1200UL;
-      clock_delay = delay;
-      if (clock_delay <= DELAY_OVERHEAD) {
-	clock_delay = 1;
-      } else {
-	clock_delay = clock_delay - DELAY_OVERHEAD;
-      }
-      clock_delay2 = clock_delay/2;
-      if(!clock_delay2) clock_delay2 = 1;
-    }
+    /* the delay is the period of the i2c clock in us */
+    i2c_set_clock(*(unsigned short*)(data+2));
+
+    DEBUGF("request for delay %dus\n", *(unsigned short*)(data+2)); 
+    break;
 
-    DEBUGF("request for delay %dus\n", clock_delay); 
+  case CMD_SET_STRETCH:
+    /* the longest time a client may hold SCL low in ms */
+    i2c_set_stretch(*(unsigned short*)(data+2));
     break;
 
   case CMD_I2C_IO:
   case CMD_I2C_IO + CMD_I2C_BEGIN:
   case CMD_I2C_IO                 + CMD_I2C_END:
   case CMD_I2C_IO + CMD_I2C_BEGIN + CMD_I2C_END:
+  case CMD_I2C_IO                                 + CMD_I2C_STATUS:
+  case CMD_I2C_IO + CMD_I2C_BEGIN                 + CMD_I2C_STATUS:
+  case CMD_I2C_IO                 + CMD_I2C_END   + CMD_I2C_STATUS:
+  case CMD_I2C_IO + CMD_I2C_BEGIN + CMD_I2C_END   + CMD_I2C_STATUS:
     // these are only allowed as class transfers
 
     return i2c_do((struct i2c_cmd*)data);
     break;
 
+  case CMD_GET_FEATURES:
+    memcpy_P(replyBuf, &features, sizeof(features));
+    return sizeof(features);
+    break;
+
   case CMD_GET_STATUS:
+    /* the number of bytes written before a data NAK comes along */
     replyBuf[0] = status;
-    return 1;
+    replyBuf[1] = i2c_acked & 0xff;
+    replyBuf[2] = i2c_acked >> 8;
+    return 3;
     break;
 
   default:
@@ -664,7 +1107,13 @@ int main(void) {
     for(;;)
 	{
         wdt_reset();
-        usbPoll();				
+
+        /* the driver NAKs the host while a packet waits for the bus */
+        if(!i2c_busy())
+          usbPoll();
+
+        /* advance the i2c bus state machine */
+        i2c_poll();
 	}
 
     return 0; 
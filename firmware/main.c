@@ -80,6 +80,32 @@ typedef byte_t uchar;
 #define CMD_I2C_IO     4
 #define CMD_I2C_BEGIN  1  // flag fo I2C_IO
 #define CMD_I2C_END    2  // flag fo I2C_IO
+#define CMD_I2C_STATUS 8  // flag fo I2C_IO, append status to IN transfers
+
+#define CMD_GET_FEATURES   16
+#define CMD_I2C_XFER_BATCH 17
+#define CMD_I2C_WAIT_ACK   18
+#define CMD_I2C_POLL_REG   19
+#define CMD_I2C_SCAN       20
+#define CMD_I2C_SMBUS      21
+#define CMD_GET_CAPS       22
+#define CMD_SET_STRETCH    23
+#define CMD_I2C_RECOVER    24
+#define CMD_SET_SPEED      25
+#define CMD_SET_POLL       26
+
+/* protocol extensions reported by CMD_GET_FEATURES */
+#define FEATURE_INLINE_STATUS  0x00000001
+#define FEATURE_XFER_BATCH     0x00000002
+#define FEATURE_INT_EP         0x00000004
+#define FEATURE_WAIT_ACK       0x00000008
+#define FEATURE_POLL_REG       0x00000010
+#define FEATURE_SCAN           0x00000020
+#define FEATURE_SMBUS          0x00000040
+#define FEATURE_CHUNK          0x00000080
+#define FEATURE_STRETCH        0x00000100
+#define FEATURE_RECOVER        0x00000200
+#define FEATURE_SPEED          0x00000400
 
 /* linux kernel flags */
 #define I2C_M_TEN		0x10	/* we have a ten bit chip address */
@@ -88,12 +114,17 @@ typedef byte_t uchar;
 #define I2C_M_REV_DIR_ADDR	0x2000
 #define I2C_M_IGNORE_NAK	0x1000
 #define I2C_M_NO_RD_ACK		0x0800
+#define I2C_M_RECV_LEN		0x0400	/* length will be first received byte */
+#define I2C_M_MORE		0x0100	/* message continues in the next request */
+
+#define I2C_SMBUS_BLOCK_MAX	32	/* maximum length given by that byte */
 
 /* To determine what functionality is present */
 #define I2C_FUNC_I2C			0x00000001
 #define I2C_FUNC_10BIT_ADDR		0x00000002
 #define I2C_FUNC_PROTOCOL_MANGLING	0x00000004 /* I2C_M_{REV_DIR_ADDR,NOSTART,..} */
 #define I2C_FUNC_SMBUS_HWPEC_CALC	0x00000008 /* SMBus 2.0 */
+#define I2C_FUNC_NOSTART		0x00000010 /* I2C_M_NOSTART */
 #define I2C_FUNC_SMBUS_READ_WORD_DATA_PEC  0x00000800 /* SMBus 2.0 */ 
 #define I2C_FUNC_SMBUS_WRITE_WORD_DATA_PEC 0x00001000 /* SMBus 2.0 */ 
 #define I2C_FUNC_SMBUS_PROC_CALL_PEC	0x00002000 /* SMBus 2.0 */
@@ -136,8 +167,71 @@ typedef byte_t uchar;
                             I2C_FUNC_SMBUS_WRITE_BLOCK_DATA_PEC | \
                             I2C_FUNC_SMBUS_I2C_BLOCK
 
+/* The optional parts below are built in on the atmega targets and left   */
+/* out on the ATtiny45 with its 4k of flash and 256 bytes of ram. Single  */
+/* ones can be added back in its Makefile, e.g. CONFIG_SMBUS=1.           */
+#if! defined (__AVR_ATtiny45__)
+#define CONFIG_DEFAULT 1
+#else
+#define CONFIG_DEFAULT 0
+#endif
+
+#ifndef CONFIG_XFER_BATCH
+#define CONFIG_XFER_BATCH CONFIG_DEFAULT  // CMD_I2C_XFER_BATCH
+#endif
+#ifndef CONFIG_WAIT_ACK
+#define CONFIG_WAIT_ACK   CONFIG_DEFAULT  // CMD_I2C_WAIT_ACK
+#endif
+#ifndef CONFIG_POLL_REG
+#define CONFIG_POLL_REG   CONFIG_DEFAULT  // CMD_I2C_POLL_REG
+#endif
+#ifndef CONFIG_SCAN
+#define CONFIG_SCAN       CONFIG_DEFAULT  // CMD_I2C_SCAN
+#endif
+#ifndef CONFIG_SMBUS
+#define CONFIG_SMBUS      CONFIG_DEFAULT  // CMD_I2C_SMBUS
+#endif
+#ifndef CONFIG_RECV_LEN
+#define CONFIG_RECV_LEN   CONFIG_DEFAULT  // I2C_M_RECV_LEN reads
+#endif
+#ifndef CONFIG_RECOVER
+#define CONFIG_RECOVER    CONFIG_DEFAULT  // CMD_I2C_RECOVER
+#endif
+#ifndef CONFIG_SPEED
+#define CONFIG_SPEED      CONFIG_DEFAULT  // CMD_SET_SPEED
+#endif
+
+/* commands run from the main loop by i2c_command() */
+#define CONFIG_COMMAND  (CONFIG_WAIT_ACK || CONFIG_POLL_REG || \
+                         CONFIG_SCAN || CONFIG_RECOVER)
+
+#if defined(I2C_INT_EP) && !CONFIG_XFER_BATCH
+#error "I2C_INT_EP transfers batches and needs CONFIG_XFER_BATCH"
+#endif
+
 /* the currently support capability is quite limited */
-const unsigned long func PROGMEM = I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+#define FUNC  (I2C_FUNC_I2C | I2C_FUNC_NOSTART | I2C_FUNC_SMBUS_EMUL | \
+               (CONFIG_SMBUS?I2C_FUNC_SMBUS_HWPEC_CALC:0) | \
+               /* CMD_I2C_SMBUS or I2C_M_RECV_LEN */ \
+               ((CONFIG_SMBUS || CONFIG_RECV_LEN)? \
+                I2C_FUNC_SMBUS_BLOCK_PROC_CALL | \
+                I2C_FUNC_SMBUS_READ_BLOCK_DATA:0))
+
+#ifdef I2C_INT_EP
+#define FEATURES_INT_EP  FEATURE_INT_EP
+#else
+#define FEATURES_INT_EP  0
+#endif
+
+#define FEATURES  (FEATURE_INLINE_STATUS | FEATURES_INT_EP | \
+                   FEATURE_CHUNK | FEATURE_STRETCH | \
+                   (CONFIG_XFER_BATCH?FEATURE_XFER_BATCH:0) | \
+                   (CONFIG_WAIT_ACK?FEATURE_WAIT_ACK:0) | \
+                   (CONFIG_POLL_REG?FEATURE_POLL_REG:0) | \
+                   (CONFIG_SCAN?FEATURE_SCAN:0) | \
+                   (CONFIG_SMBUS?FEATURE_SMBUS:0) | \
+                   (CONFIG_RECOVER?FEATURE_RECOVER:0) | \
+                   (CONFIG_SPEED?FEATURE_SPEED:0))
 
 #ifdef DEBUG
 #define DEBUGF(format, args...) printf_P(PSTR(format), ##args)
@@ -159,12 +253,33 @@ static FILE mystdout = FDEV_SETUP_STREAM(uart_putchar, NULL,
 
 /* ------------------------------------------------------------------------- */
 #define DEFAULT_DELAY 10  // default 10us (100khz)
-static unsigned short clock_delay  = DEFAULT_DELAY;
-static unsigned short clock_delay2 = DEFAULT_DELAY/2;
 
 static unsigned short expected;
 static unsigned char saved_cmd;
 
+/* status and read data of a batch transfer are buffered in ram, so are */
+/* the replies of the other optional commands */
+#ifndef BATCH_SIZE
+#if CONFIG_XFER_BATCH && !defined (__AVR_ATtiny45__)
+#define BATCH_SIZE 128
+#elif CONFIG_XFER_BATCH || CONFIG_SMBUS
+#define BATCH_SIZE 34   // status, count and data of a SMBus block read
+#elif CONFIG_SCAN
+#define BATCH_SIZE 16   // address map of a scan
+#else
+#define BATCH_SIZE 4    // reply of CMD_I2C_POLL_REG
+#endif
+#endif
+
+static uchar batch_buf[BATCH_SIZE];
+static uchar batch_used;
+
+#if CONFIG_XFER_BATCH
+static uchar batch_hdr[3];        // flags, addr and len of current segment
+static uchar batch_hdr_len;
+static uchar batch_segs, batch_seg, batch_left;
+#endif
+
 #if! defined (__AVR_ATtiny45__)
 #define I2C_PORT   PORTC
 #define I2C_PIN    PINC
@@ -179,13 +294,270 @@ static unsigned char saved_cmd;
 #define I2C_SCL    _BV(5)
 #endif
 
+/* ------------------------------------------------------------------------- */
+/* Timer 0 runs freely at F_CPU/1024 as a coarse time base. It wraps after  */
+/* about 13ms at 20MHz, so it has to be sampled more often than that.       */
+#define TIMER_TICKS(ms)  ((F_CPU/1024UL)*(ms)/1000UL)
+#define TIMER_MS(ticks)  ((ticks)*1024UL/(F_CPU/1000UL))
+
+static void timer_init(void) {
+#ifdef TCCR0B
+  TCCR0B = _BV(CS02) | _BV(CS00);
+#else
+  TCCR0 = _BV(CS02) | _BV(CS00);
+#endif
+}
+
+/* timer ticks passed since *last, which is advanced to now */
+static uchar timer_elapsed(uchar *last) {
+  uchar now = TCNT0, ticks = now - *last;
+
+  *last = now;
+  return ticks;
+}
+
+/* A client may hold SCL low to slow down the transfer. The wait for it */
+/* is bounded by stretch_ticks, once a client held it longer all waits  */
+/* end at once until the next start condition and the message fails    */
+/* with STATUS_TIMEOUT. Both variables are shared with i2cfast.S.       */
+#define DEFAULT_STRETCH  25   // ms
+#define MAX_STRETCH      250  // ms, well below the watchdog timeout
+
+unsigned short stretch_ticks = TIMER_TICKS(DEFAULT_STRETCH);
+uchar i2c_stretched;
+
+static void i2c_set_stretch(unsigned short ms) {
+  if(ms > MAX_STRETCH) ms = MAX_STRETCH;
+
+  stretch_ticks = TIMER_TICKS(ms);
+  if(!stretch_ticks) stretch_ticks = 1;
+}
+
+/* account the time spent waiting for SCL, returns non-zero once the */
+/* wait has to be given up */
+static uchar i2c_stretch_expired(unsigned short *ticks, uchar *last) {
+  if(!i2c_stretched && ((*ticks += timer_elapsed(last)) > stretch_ticks))
+    i2c_stretched = 1;
+
+  return i2c_stretched;
+}
+
+#ifdef I2C_HW_TWI
+/* use the TWI hardware of the mega8/88/168/328 on PC4 (SDA) and PC5 (SCL) */
+#if defined (__AVR_ATtiny45__) || !defined(TWBR)
+#error "I2C_HW_TWI requires a cpu with TWI hardware"
+#endif
+#ifdef I2C_FAST
+#error "I2C_FAST is a bitbanging option and cannot be used with I2C_HW_TWI"
+#endif
+
+/* TWBR should be >= 10 in master mode and the bus must not exceed 400kHz */
+#define TWI_MIN_TWBR  (((F_CPU/400000UL-16)/2 > 10)?((F_CPU/400000UL-16)/2):10)
+
+/* delay range reported by CMD_GET_CAPS, 400kHz to TWBR 255 at prescaler 64 */
+#define MIN_DELAY  3
+#define MAX_DELAY  ((16UL + 2*255*64)/(F_CPU/1000000UL))
+
+/* SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS), the delay value */
+/* used by the bitbanging code is the full clock period in us */
+static void i2c_set_clock(unsigned short delay) {
+  unsigned long twbr = ((F_CPU/1000000UL) * delay - 16)/2;
+  uchar twps = 0;
+
+  if(((F_CPU/1000000UL) * delay < 16) || (twbr < TWI_MIN_TWBR))
+    twbr = TWI_MIN_TWBR;
+
+  while((twbr > 255) && (twps < 3)) {
+    twbr /= 4;
+    twps++;
+  }
+  if(twbr > 255) twbr = 255;
+
+  TWSR = twps;            // TWPS1:0 are the lowest bits
+  TWBR = twbr;
+}
+
+/* the TWI waits for a stretched clock by itself, it is reset to release */
+/* the bus once that takes too long */
+static void i2c_twi_reset(void) {
+  TWCR = 0;
+  TWCR = _BV(TWEN);
+}
+
+/* wait for the current operation and return the TWI status */
+static uchar i2c_twi_wait(void) {
+  unsigned short ticks = 0;
+  uchar last = TCNT0;
+
+  while(!(TWCR & _BV(TWINT))) {
+    if(i2c_stretch_expired(&ticks, &last)) {
+      i2c_twi_reset();
+      return 0;
+    }
+  }
+
+  return TWSR & 0xf8;
+}
+
+static void i2c_init(void) {
+  /* enable the internal pullups like the bitbanging code does */
+  I2C_DDR &= ~(I2C_SDA | I2C_SCL);
+  I2C_PORT |= I2C_SDA | I2C_SCL;
+
+  i2c_set_clock(DEFAULT_DELAY);
+  TWCR = _BV(TWEN);
+
+  /* no bytes to be expected */
+  expected = 0;
+}
+
+/* i2c start condition */
+static void i2c_start(void) {
+  i2c_stretched = 0;
+  TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
+  i2c_twi_wait();
+}
+
+/* i2c repeated start condition, the TWI handles this by itself */
+static void i2c_repstart(void) {
+  i2c_start();
+}
+
+/* i2c stop condition */
+void i2c_stop(void) {
+  unsigned short ticks = 0;
+  uchar last = TCNT0;
+
+  TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+  while(TWCR & _BV(TWSTO)) {
+    if(i2c_stretch_expired(&ticks, &last)) {
+      i2c_twi_reset();
+      break;
+    }
+  }
+}
+
+uchar i2c_put_u08(uchar b) {
+  uchar status;
+
+  TWDR = b;
+  TWCR = _BV(TWINT) | _BV(TWEN);
+  status = i2c_twi_wait();
+
+  /* SLA+W, SLA+R or data byte acknowledged */
+  return((status == 0x18) || (status == 0x40) || (status == 0x28));
+}
+
+uchar i2c_get_u08(uchar last) {
+  /* ACK all but the last byte */
+  TWCR = _BV(TWINT) | _BV(TWEN) | (last?0:_BV(TWEA));
+  i2c_twi_wait();
+
+  return TWDR;
+}
+
+#else
+
+#ifdef I2C_FAST
+/* Hand timed 400kHz byte transfers from i2cfast.S are used for delays */
+/* of 2us and below. They only switch the DDR bits, so the PORT bits */
+/* have to stay low and external pullups are required. */
+#ifndef ENABLE_SCL_EXPAND
+#error "I2C_FAST requires ENABLE_SCL_EXPAND"
+#endif
+#define I2C_IS_AN_OPEN_COLLECTOR_BUS
+#define I2C_FAST_DELAY 2
+
+extern uchar i2c_fast_put_u08(uchar b);
+extern uchar i2c_fast_get_u08(uchar last);
+
+static uchar clock_fast = 0;
+#endif
+
+/* The delay function used delays 4 system ticks per cycle. It is */
+/* called twice per clock edge, once with the full delay and once */
+/* with the half one, so one bit takes 8 * (clock_delay + clock_delay2) */
+/* cycles plus the overhead of the surrounding code. That overhead was */
+/* scoped at 90 cycles per bit on an open collector bus with the SCL */
+/* read back for clock stretching. The other configurations differ by */
+/* the instructions they add or save per bit: driving PORT next to DDR */
+/* costs 2 cycles for each of the 3 pin updates, the read back 3. */
+#ifndef I2C_BIT_OVERHEAD
+#if defined(ENABLE_SCL_EXPAND) && defined(I2C_IS_AN_OPEN_COLLECTOR_BUS)
+#define I2C_BIT_OVERHEAD 90UL    // DDR updates, SCL read back
+#elif defined(ENABLE_SCL_EXPAND)
+#define I2C_BIT_OVERHEAD 96UL    // DDR and PORT updates, SCL read back
+#else
+#define I2C_BIT_OVERHEAD 89UL    // SCL by PORT only, no read back
+#endif
+#endif
+
+#define CLOCK_CYCLES(us) ((F_CPU/1000UL)*(us)/1000UL)
+#define CLOCK_LOOPS(us)  ((CLOCK_CYCLES(us) > I2C_BIT_OVERHEAD + 24)? \
+			  (CLOCK_CYCLES(us) - I2C_BIT_OVERHEAD)/8 : 3)
+#define CLOCK_DELAY2(us) (CLOCK_LOOPS(us)/3)
+#define CLOCK_DELAY(us)  (CLOCK_LOOPS(us) - CLOCK_DELAY2(us))
+
+/* The shortest loop count adds 24 cycles to the overhead, shorter */
+/* periods can't be reached. At 12MHz that is 10us or 100kHz. */
+#define CLOCK_MIN_DELAY  (((I2C_BIT_OVERHEAD + 24)*1000000UL + F_CPU - 1)/F_CPU)
+
+/* delay range reported by CMD_GET_CAPS, from the shortest reachable */
+/* period to the 16 bit limit of the loop counters */
+#ifdef I2C_FAST
+#define MIN_DELAY  I2C_FAST_DELAY
+#else
+#define MIN_DELAY  CLOCK_MIN_DELAY
+#endif
+#define MAX_DELAY  ((0xffffUL*8 + I2C_BIT_OVERHEAD)/(F_CPU/1000000UL))
+
+/* loop counts for 1 to 16us, calculated for F_CPU at build time */
+#define CLOCK_TABLE_SIZE 16
+static const uchar clock_table[CLOCK_TABLE_SIZE] PROGMEM = {
+  CLOCK_LOOPS(1),  CLOCK_LOOPS(2),  CLOCK_LOOPS(3),  CLOCK_LOOPS(4),
+  CLOCK_LOOPS(5),  CLOCK_LOOPS(6),  CLOCK_LOOPS(7),  CLOCK_LOOPS(8),
+  CLOCK_LOOPS(9),  CLOCK_LOOPS(10), CLOCK_LOOPS(11), CLOCK_LOOPS(12),
+  CLOCK_LOOPS(13), CLOCK_LOOPS(14), CLOCK_LOOPS(15), CLOCK_LOOPS(16)
+};
+
+static unsigned short clock_delay  = CLOCK_DELAY(DEFAULT_DELAY);
+static unsigned short clock_delay2 = CLOCK_DELAY2(DEFAULT_DELAY);
+
+/* set the bit clock period in us, short periods are limited */
+/* by the code overhead to the fastest possible clock */
+static void i2c_set_clock(unsigned short delay) {
+  unsigned long loops;
+
+#ifdef I2C_FAST
+  clock_fast = (delay <= I2C_FAST_DELAY);
+#endif
+
+  /* with I2C_FAST the periods between the fast transfers and */
+  /* the shortest bitbanged one run at the latter */
+  if(delay < CLOCK_MIN_DELAY) delay = CLOCK_MIN_DELAY;
+
+  if(delay <= CLOCK_TABLE_SIZE)
+    loops = pgm_read_byte(clock_table + delay - 1);
+  else {
+    loops = CLOCK_LOOPS((unsigned long)delay);
+    if(loops > 0xffff) loops = 0xffff;
+  }
+
+  clock_delay2 = loops/3;
+  clock_delay = loops - clock_delay2;
+}
+
 static void i2c_io_set_sda(uchar hi) {
   if(hi) {
     I2C_DDR  &= ~I2C_SDA;    // high -> input
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
     I2C_PORT |=  I2C_SDA;    // with pullup
+#endif
   } else {
     I2C_DDR  |=  I2C_SDA;    // low -> output
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
     I2C_PORT &= ~I2C_SDA;    // drive low
+#endif
   }
 }
 
@@ -198,13 +570,22 @@ static void i2c_io_set_scl(uchar hi) {
   _delay_loop_2(clock_delay2);
   if(hi) {
     I2C_DDR &= ~I2C_SCL;          // port is input
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
     I2C_PORT |= I2C_SCL;          // enable pullup
+#endif
+
+    // wait while pin is pulled low by client, but not forever
+    if(!(I2C_PIN & I2C_SCL)) {
+      unsigned short ticks = 0;
+      uchar last = TCNT0;
 
-    // wait while pin is pulled low by client
-    while(!(I2C_PIN & I2C_SCL));
+      while(!(I2C_PIN & I2C_SCL) && !i2c_stretch_expired(&ticks, &last));
+    }
   } else {
     I2C_DDR |= I2C_SCL;           // port is output
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
     I2C_PORT &= ~I2C_SCL;         // drive it low
+#endif
   }
   _delay_loop_2(clock_delay);
 #else
@@ -218,10 +599,18 @@ static void i2c_io_set_scl(uchar hi) {
 static void i2c_init(void) {
   /* init the sda/scl pins */
   I2C_DDR &= ~I2C_SDA;            // port is input
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
   I2C_PORT |= I2C_SDA;            // enable pullup
+#else
+  I2C_PORT &= ~I2C_SDA;           // external pullups only
+#endif
 #ifdef ENABLE_SCL_EXPAND
   I2C_DDR &= ~I2C_SCL;            // port is input
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
   I2C_PORT |= I2C_SCL;            // enable pullup
+#else
+  I2C_PORT &= ~I2C_SCL;           // external pullups only
+#endif
 #else
   I2C_DDR |= I2C_SCL;             // port is output
 #endif
@@ -238,6 +627,7 @@ static void i2c_scl_toggle(void) {
 
 /* i2c start condition */
 static void i2c_start(void) {
+  i2c_stretched = 0;
   i2c_io_set_sda(0);
   i2c_io_set_scl(0);
 }
@@ -263,6 +653,11 @@ void i2c_stop(void) {
 uchar i2c_put_u08(uchar b) {
   char i;
 
+#ifdef I2C_FAST
+  if(clock_fast)
+    return i2c_fast_put_u08(b);
+#endif
+
   for (i=7;i>=0;i--) {
     if ( b & (1<<i) )  i2c_io_set_sda(1);
     else               i2c_io_set_sda(0);
@@ -283,6 +678,11 @@ uchar i2c_get_u08(uchar last) {
   char i;
   uchar c,b = 0;
 
+#ifdef I2C_FAST
+  if(clock_fast)
+    return i2c_fast_get_u08(last);
+#endif
+
   i2c_io_set_sda(1);            // make sure pullups are activated
   i2c_io_set_scl(0);            // clock LOW
 
@@ -303,18 +703,161 @@ uchar i2c_get_u08(uchar last) {
   return b;                     // return received byte
 }
 
-#ifdef DEBUG
-void i2c_scan(void) {
-  uchar i = 0;
+#endif
 
-  for(i=0;i<127;i++) {
-    i2c_start();                  // do start transition
-    if(i2c_put_u08(i << 1))       // send DEVICE address
-      DEBUGF("I2C device at address 0x%x\n", i);
+static unsigned short bus_delay = DEFAULT_DELAY, cur_delay = DEFAULT_DELAY;
 
-    i2c_stop();
+static void i2c_use_delay(unsigned short delay) {
+  /* calculating the clock may be expensive */
+  if(delay != cur_delay) {
+    i2c_set_clock(delay);
+    cur_delay = delay;
   }
 }
+
+#if CONFIG_SPEED
+/* A slow client doesn't have to slow down the whole bus, the clock of  */
+/* up to SPEED_SLOTS addresses can be set individually. All others use */
+/* the delay set by CMD_SET_DELAY. A delay of 0 marks a free slot.      */
+#define SPEED_SLOTS  8
+
+static struct {
+  uchar addr;
+  unsigned short delay;
+} speed_table[SPEED_SLOTS];
+
+/* switch to the clock of the given client before addressing it */
+static void i2c_select(uchar addr) {
+  unsigned short delay = bus_delay;
+  uchar i;
+
+  for(i=0;i<SPEED_SLOTS;i++)
+    if(speed_table[i].delay && (speed_table[i].addr == addr))
+      delay = speed_table[i].delay;
+
+  i2c_use_delay(delay);
+}
+
+/* set the delay of a client, 0 removes it from the table. Returns 0 */
+/* if the table is full. */
+static uchar i2c_set_speed(uchar addr, unsigned short delay) {
+  uchar i, slot = SPEED_SLOTS;
+
+  for(i=0;i<SPEED_SLOTS;i++) {
+    if(speed_table[i].delay && (speed_table[i].addr == addr)) {
+      slot = i;
+      break;
+    }
+    if(!speed_table[i].delay && (slot == SPEED_SLOTS))
+      slot = i;
+  }
+
+  if(slot == SPEED_SLOTS)
+    return !delay;
+
+  speed_table[slot].addr = addr;
+  speed_table[slot].delay = delay;
+  return 1;
+}
+#else
+/* all clients use the delay set by CMD_SET_DELAY */
+#define i2c_select(addr)
+#endif
+
+#if CONFIG_SCAN
+/* A scan probes one address per step of the main loop and sets one bit  */
+/* per acknowledging address in the 16 byte map. Addresses whose block of */
+/* 8 has its bit set in rd are probed by reading a byte, the others by an */
+/* empty write. */
+#define SCAN_SIZE  16
+
+static uchar i2c_probe(uchar addr, unsigned short rd) {
+  uchar ack;
+
+  i2c_select(addr);
+  i2c_start();                    // do start transition
+  if(rd & (1u << (addr >> 3))) {
+    if((ack = i2c_put_u08((addr << 1) | 1)))
+      i2c_get_u08(1);             // NAK the byte to end the read
+  } else
+    ack = i2c_put_u08(addr << 1); // send DEVICE address
+
+  i2c_stop();
+  return ack;
+}
+#endif
+
+#if CONFIG_RECOVER
+/* Free a bus whose SDA is held low by a client that lost track of an */
+/* interrupted transfer: up to 9 clock pulses let it shift out the rest */
+/* of its byte, then a stop condition resets it. The lines are driven   */
+/* directly, so this works for both the bitbanging and the TWI code.    */
+/* The reply holds the line states before and after the recovery and   */
+/* the number of clock pulses needed.                                   */
+#define RECOVER_SDA    0x01
+#define RECOVER_SCL    0x02
+#define RECOVER_US     5     // half clock period, 100kHz
+
+static uchar i2c_lines(void) {
+  return ((I2C_PIN & I2C_SDA)?RECOVER_SDA:0) |
+    ((I2C_PIN & I2C_SCL)?RECOVER_SCL:0);
+}
+
+static void i2c_recover_line(uchar line, uchar hi) {
+  if(hi) {
+    I2C_DDR &= ~line;        // high -> input
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
+    I2C_PORT |= line;        // with pullup
+#endif
+
+    // SCL may still be stretched, but not forever
+    if(line == I2C_SCL) {
+      unsigned short ticks = 0;
+      uchar last = TCNT0;
+
+      i2c_stretched = 0;
+      while(!(I2C_PIN & I2C_SCL) && !i2c_stretch_expired(&ticks, &last));
+    }
+  } else {
+    I2C_DDR |= line;         // low -> output
+#ifndef I2C_IS_AN_OPEN_COLLECTOR_BUS
+    I2C_PORT &= ~line;       // drive low
+#endif
+  }
+  _delay_us(RECOVER_US);
+}
+
+static void i2c_recover(uchar *reply) {
+  uchar pulses;
+
+  reply[0] = i2c_lines();
+
+#ifdef I2C_HW_TWI
+  TWCR = 0;                  // hand the pins back to the port
+#endif
+
+  i2c_recover_line(I2C_SDA, 1);
+  i2c_recover_line(I2C_SCL, 1);
+
+  for(pulses = 0; (pulses < 9) && !(I2C_PIN & I2C_SDA); pulses++) {
+    wdt_reset();
+    i2c_recover_line(I2C_SCL, 0);
+    i2c_recover_line(I2C_SCL, 1);
+  }
+
+  /* stop condition */
+  i2c_recover_line(I2C_SCL, 0);
+  i2c_recover_line(I2C_SDA, 0);
+  i2c_recover_line(I2C_SCL, 1);
+  i2c_recover_line(I2C_SDA, 1);
+
+#ifdef I2C_HW_TWI
+  TWCR = _BV(TWEN);
+#endif
+
+  reply[1] = i2c_lines();
+  reply[2] = pulses;
+}
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -330,42 +873,713 @@ struct i2c_cmd {
 #define STATUS_IDLE          0
 #define STATUS_ADDRESS_ACK   1
 #define STATUS_ADDRESS_NAK   2
+#define STATUS_PEC_ERROR     3
+#define STATUS_DATA_NAK      4
+#define STATUS_TIMEOUT       5
 
 static uchar status = STATUS_IDLE;
 
-static uchar i2c_do(struct i2c_cmd *cmd) {
-  uchar addr;
+/* a message that failed aborts the rest of the transaction */
+static uchar i2c_failed(void) {
+  return (status == STATUS_ADDRESS_NAK) || (status == STATUS_DATA_NAK) ||
+    (status == STATUS_TIMEOUT);
+}
 
-  DEBUGF("i2c %s at 0x%02x, len = %d\n", 
-	   (cmd->flags&I2C_M_RD)?"rd":"wr", cmd->addr, cmd->len); 
+/* status of a refused address or data byte, a client which stretched */
+/* the clock for too long may have made it look like that */
+static uchar i2c_nak_status(uchar nak) {
+  return i2c_stretched?STATUS_TIMEOUT:nak;
+}
 
-  /* normal 7bit address */
-  addr = ( cmd->addr << 1 );
-  if (cmd->flags & I2C_M_RD )
-    addr |= 1;
+#if CONFIG_WAIT_ACK || CONFIG_POLL_REG
+/* The polling commands access the bus at most once per step of the main */
+/* loop and keep their time in timer ticks. Their timeouts are limited to */
+/* 1s to stay well below the host's timeout, so the ticks fit 16 bits.   */
+static unsigned short job_ticks, job_limit, job_count;
+static uchar job_last;
+
+static void job_begin(unsigned short timeout) {
+  if(timeout > 1000) timeout = 1000;
+
+  job_ticks = job_count = 0;
+  job_limit = TIMER_TICKS(timeout);
+  job_last = TCNT0;
+}
+
+/* account the time passed, returns non-zero once the timeout expired */
+static uchar job_expired(void) {
+  job_ticks += timer_elapsed(&job_last);
+  return job_ticks >= job_limit;
+}
+#endif
+
+#if CONFIG_WAIT_ACK
+/* Address the slave until it acknowledges, e.g. once an eeprom has  */
+/* finished its write cycle. The reply holds the status and the time */
+/* this took in ms. Returns non-zero once done. */
+static uchar i2c_wait_ack(uchar addr) {
+  unsigned short ms;
+
+  i2c_select(addr);
+  i2c_start();
+  status = (i2c_put_u08(addr << 1) && !i2c_stretched)?
+    STATUS_ADDRESS_ACK:i2c_nak_status(STATUS_ADDRESS_NAK);
+  i2c_stop();
+
+  if(!job_expired() && (status == STATUS_ADDRESS_NAK))
+    return 0;
+
+  ms = TIMER_MS(job_ticks);
+  batch_buf[0] = status;
+  batch_buf[1] = ms & 0xff;
+  batch_buf[2] = ms >> 8;
+  batch_used = 3;
+  return 1;
+}
+#endif
 
-  if(cmd->cmd & CMD_I2C_BEGIN) 
+#if CONFIG_POLL_REG
+/* interval and timeout in ms of CMD_I2C_POLL_REG, set by CMD_SET_POLL */
+static unsigned short poll_interval = 1, poll_timeout = 100;
+static unsigned short poll_next;    // ticks until the next read
+
+/* Read a register until (value & mask) == match or the timeout expires, */
+/* e.g. to wait for a conversion done bit. The reply holds the status,   */
+/* the value read last and the number of reads. Returns non-zero once    */
+/* done. */
+static uchar i2c_poll_reg(uchar addr, uchar reg, uchar mask, uchar match) {
+  if(job_ticks >= poll_next) {
+    poll_next = job_ticks + TIMER_TICKS(poll_interval);
+    job_count++;
+
+    status = STATUS_ADDRESS_NAK;
+    i2c_select(addr);
     i2c_start();
-  else 
-    i2c_repstart();    
+    if(i2c_put_u08(addr << 1) && i2c_put_u08(reg)) {
+      i2c_repstart();
+      if(i2c_put_u08((addr << 1) | 1)) {
+	batch_buf[1] = i2c_get_u08(1);
+	status = STATUS_ADDRESS_ACK;
+      }
+    }
+    i2c_stop();
+
+    /* a stuck bus won't get any better */
+    if(i2c_stretched) {
+      status = STATUS_TIMEOUT;
+      goto done;
+    }
+
+    if((status == STATUS_ADDRESS_ACK) && ((batch_buf[1] & mask) == match))
+      goto done;
+  }
+
+  if(!job_expired())
+    return 0;
 
-  // send DEVICE address
-  if(!i2c_put_u08(addr)) {
-    DEBUGF("I2C read: address error @ %x\n", addr);
+ done:
+  batch_buf[0] = status;
+  batch_buf[2] = job_count & 0xff;
+  batch_buf[3] = job_count >> 8;
+  batch_used = 4;
+  return 1;
+}
+#endif
+
+#if CONFIG_SMBUS
+/* ------------------------------------------------------------------------- */
+/* A SMBus transaction runs completely on the device. The host maps each    */
+/* protocol to an optional write and an optional read phase. wValue holds   */
+/* the address and the flags below, wIndex the command byte and either the  */
+/* data byte or the read length. The write phase sends the command, the     */
+/* data byte and the payload of an OUT request. The result is a status byte */
+/* followed by the read data, it's fetched through CMD_I2C_XFER_BATCH once */
+/* the transaction is done.                                                 */
+#define SMBUS_CMD    0x01  // send the command byte
+#define SMBUS_DATA   0x02  // send the data byte
+#define SMBUS_READ   0x04  // read phase
+#define SMBUS_BLOCK  0x08  // the first byte read is the block length
+#define SMBUS_PEC    0x10  // append or check a packet error code
+
+static uchar smbus_addr, smbus_flags, smbus_cmd, smbus_byte;
+static uchar smbus_len, smbus_pec;
+
+/* crc-8 (x^8 + x^2 + x + 1) of SMBus packet error checking */
+static void smbus_crc(uchar b) {
+  uchar i;
+
+  smbus_pec ^= b;
+  for(i=0;i<8;i++)
+    smbus_pec = (smbus_pec & 0x80)?(smbus_pec << 1) ^ 0x07:(smbus_pec << 1);
+}
+
+static uchar smbus_put(uchar b) {
+  smbus_crc(b);
+  return i2c_put_u08(b);
+}
 
+/* a data byte the slave refuses ends the transaction */
+static void smbus_data(uchar b) {
+  if((status == STATUS_ADDRESS_ACK) && !smbus_put(b))
+    status = STATUS_DATA_NAK;
+}
+
+static uchar smbus_get(uchar last) {
+  uchar c = i2c_get_u08(last);
+
+  smbus_crc(c);
+  batch_buf[batch_used++] = c;
+  return c;
+}
+
+/* keep the bytes of the setup packet, the main loop runs the transaction */
+static void smbus_setup(uchar *data) {
+  smbus_addr = data[2];
+  smbus_flags = data[3];
+  smbus_cmd = data[4];
+  smbus_byte = smbus_len = data[5];
+
+  if(smbus_len > BATCH_SIZE-2)
+    smbus_len = BATCH_SIZE-2;
+}
+
+/* start the transaction and send the bytes of the setup packet */
+static void smbus_start(void) {
+  i2c_select(smbus_addr);
+  smbus_pec = 0;
+
+  status = STATUS_ADDRESS_ACK;
+  batch_used = 1;
+
+  /* everything but a read without command starts with a write */
+  if((smbus_flags & SMBUS_CMD) || !(smbus_flags & SMBUS_READ)) {
+    i2c_start();
+    if(!smbus_put(smbus_addr << 1))
+      status = STATUS_ADDRESS_NAK;
+    else {
+      if(smbus_flags & SMBUS_CMD)  smbus_data(smbus_cmd);
+      if(smbus_flags & SMBUS_DATA) smbus_data(smbus_byte);
+    }
+  }
+}
+
+/* run the read phase and store the status in front of the data */
+static void smbus_end(void) {
+  uchar i, n, pec = smbus_flags & SMBUS_PEC;
+
+  if(status != STATUS_ADDRESS_ACK)
+    goto done;
+
+  if(!(smbus_flags & SMBUS_READ)) {
+    if(pec)
+      smbus_data(smbus_pec);
+    goto done;
+  }
+
+  if(smbus_flags & SMBUS_CMD)
+    i2c_repstart();
+  else
+    i2c_start();
+
+  if(!smbus_put((smbus_addr << 1) | 1)) {
     status = STATUS_ADDRESS_NAK;
-    expected = 0;
+    goto done;
+  }
+
+  n = smbus_len;
+  if(smbus_flags & SMBUS_BLOCK) {
+    n = smbus_get(0);
+
+    /* an invalid count still needs a NAKed byte to end the read, */
+    /* the host rejects the count */
+    if(!n || (n > smbus_len)) {
+      i2c_get_u08(1);
+      goto done;
+    }
+  }
+
+  /* a quick read still reads a byte and NAKs it to end the read, */
+  /* as the scan does */
+  if(!n && !pec)
+    i2c_get_u08(1);
+
+  for(i=0;i<n;i++)
+    smbus_get((i == n-1) && !pec);
+
+  if(pec && (i2c_get_u08(1) != smbus_pec))
+    status = STATUS_PEC_ERROR;
+
+ done:
+  if(i2c_stretched)
+    status = STATUS_TIMEOUT;
+
+  i2c_stop();
+  batch_buf[0] = status;
+}
+#endif
+
+#if CONFIG_XFER_BATCH
+/* ------------------------------------------------------------------------- */
+/* A batch transfer runs a complete combined i2c transaction. The OUT stage  */
+/* carries one 3 byte header (flags, addr, len) per segment, followed by the */
+/* payload for write segments. The main loop runs the segments as the data   */
+/* arrives. The following IN stage returns one status byte per segment       */
+/* followed by the data of all read segments.                                */
+
+static void batch_begin(uchar segs) {
+  DEBUGF("batch of %d segments\n", segs);
+
+  /* the status bytes must fit into the buffer */
+  if(segs > BATCH_SIZE)
+    segs = 0;
+
+  batch_segs = segs;
+  batch_seg = batch_hdr_len = 0;
+  batch_used = segs;
+  memset(batch_buf, STATUS_IDLE, segs);
+
+  status = STATUS_ADDRESS_ACK;
+}
+
+static void batch_next(void) {
+  batch_hdr_len = 0;
+
+  /* stop after the last segment if the transaction didn't fail earlier */
+  if((++batch_seg == batch_segs) && (status == STATUS_ADDRESS_ACK))
     i2c_stop();
-  } else {  
+}
+
+/* header of a segment complete, address the slave */
+static void batch_segment(void) {
+  uchar addr, c;
+
+  addr = batch_hdr[1] << 1;
+  if(batch_hdr[0] & I2C_M_RD)
+    addr |= 1;
+
+  batch_left = batch_hdr[2];
+
+  /* a failed segment aborts the rest of the transaction */
+  if(status == STATUS_ADDRESS_ACK) {
+    i2c_select(batch_hdr[1]);
+
+    if(!batch_seg)
+      i2c_start();
+    else
+      i2c_repstart();
+
+    if(i2c_put_u08(addr) && !i2c_stretched)
+      batch_buf[batch_seg] = STATUS_ADDRESS_ACK;
+    else {
+      DEBUGF("batch: address error @ %x\n", addr);
+      status = i2c_nak_status(STATUS_ADDRESS_NAK);
+      batch_buf[batch_seg] = status;
+      i2c_stop();
+    }
+  }
+
+  /* reads don't wait for further data from the host */
+  if(batch_hdr[0] & I2C_M_RD) {
+    while(batch_left) {
+      batch_left--;
+      c = 0;
+      if(batch_buf[batch_seg] == STATUS_ADDRESS_ACK)
+	c = i2c_get_u08(batch_left == 0);
+
+      /* a short reply tells the host that the buffer overflowed */
+      if(batch_used < BATCH_SIZE)
+	batch_buf[batch_used++] = c;
+    }
+
+    if(i2c_stretched && (batch_buf[batch_seg] == STATUS_ADDRESS_ACK)) {
+      status = STATUS_TIMEOUT;
+      batch_buf[batch_seg] = STATUS_TIMEOUT;
+      i2c_stop();
+    }
+  }
+
+  if(!batch_left)
+    batch_next();
+}
+
+static void batch_write(uchar *data, uchar len) {
+  while(len-- && (batch_seg < batch_segs)) {
+    if(batch_hdr_len < sizeof(batch_hdr)) {
+      batch_hdr[batch_hdr_len++] = *data++;
+      if(batch_hdr_len == sizeof(batch_hdr))
+	batch_segment();
+    } else {
+      /* payload of a write segment, a refused byte aborts the rest */
+      /* of the transaction */
+      if((batch_buf[batch_seg] == STATUS_ADDRESS_ACK) &&
+	 (!i2c_put_u08(*data) || i2c_stretched)) {
+	DEBUGF("batch: write failed\n");
+	status = i2c_nak_status(STATUS_DATA_NAK);
+	batch_buf[batch_seg] = status;
+	i2c_stop();
+      }
+
+      data++;
+      if(!--batch_left)
+	batch_next();
+    }
+  }
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* The bus is driven by a small state machine. The usb callbacks only queue */
+/* work and collect results, i2c_poll() advances the machine by one step    */
+/* from the main loop. A packet which has to wait for the bus is held back  */
+/* by not polling the usb driver, see i2c_busy().                           */
+#define I2C_IDLE     0
+#define I2C_ADDRESS  1   // start condition and address pending
+#define I2C_DATA     2   // data moving through the read or write buffer
+#define I2C_BATCH    3   // batch segments coming through the write fifo
+#define I2C_SMBUS    4   // SMBus transaction pending
+#define I2C_PAYLOAD  5   // SMBus payload coming through the write fifo
+#define I2C_COMMAND  6   // scan, ack or register polling, or bus recovery
+
+static uchar i2c_state = I2C_IDLE;
+static uchar i2c_addr;              // address byte incl. read bit
+static unsigned short i2c_left;     // data bytes still to be transferred
+static unsigned short i2c_acked;    // data bytes written and acknowledged
+static uchar i2c_ignore_nak;        // I2C_M_IGNORE_NAK
+#if CONFIG_COMMAND
+static uchar i2c_args[4];           // wValue and wIndex of I2C_COMMAND
+#endif
+
+/* Read data is fetched from the bus ahead of the usb IN packets, so */
+/* the packets can be served immediately while the next chunk is read */
+/* from the main loop. One chunk matches one IN packet. */
+#define READ_AHEAD 8
+
+static uchar ahead_buf[READ_AHEAD];
+static uchar ahead_pos, ahead_len;
+
+#if CONFIG_RECV_LEN
+/* For I2C_M_RECV_LEN reads the first byte gives the number of bytes */
+/* to follow. The host asks for I2C_SMBUS_BLOCK_MAX bytes more than  */
+/* that, anything beyond (e.g. a PEC byte) is read in addition. */
+static uchar recv_len, recv_extra;
+#else
+#define recv_len 0
+#endif
+
+/* A message too long for one request is split by the host. The parts */
+/* after the first come with I2C_M_NOSTART and go on with the data, all */
+/* but the last come with I2C_M_MORE and ACK their last byte read. */
+static uchar i2c_more;
+
+/* Write data is acknowledged to the host as soon as it has been copied */
+/* into this fifo. The main loop then clocks it onto the bus, one byte */
+/* per step. The size must be a power of two. */
+#ifndef WRITE_FIFO
+#if! defined (__AVR_ATtiny45__)
+#define WRITE_FIFO 64
+#else
+#define WRITE_FIFO 16
+#endif
+#endif
+
+static uchar wb_buf[WRITE_FIFO];
+static uchar wb_tail, wb_fill;
+
+/* take the oldest byte out of the fifo */
+static uchar wb_get(void) {
+  uchar c = wb_buf[wb_tail];
+
+  wb_tail = (wb_tail + 1) & (WRITE_FIFO-1);
+  wb_fill--;
+  return c;
+}
+
+#if CONFIG_COMMAND
+/* run a step of a queued command, returns non-zero once it is done and */
+/* its reply is in the batch buffer */
+static uchar i2c_command(void) {
+#if CONFIG_SCAN
+  uchar i;
+#endif
+
+  switch(saved_cmd) {
+#if CONFIG_WAIT_ACK
+  case CMD_I2C_WAIT_ACK:
+    return i2c_wait_ack(i2c_args[0]);
+#endif
+
+#if CONFIG_POLL_REG
+  case CMD_I2C_POLL_REG:
+    return i2c_poll_reg(i2c_args[0], i2c_args[1], i2c_args[2], i2c_args[3]);
+#endif
+
+#if CONFIG_SCAN
+  case CMD_I2C_SCAN:
+    /* the first address of wIndex advances with every probe */
+    i = i2c_args[2];
+    if((i > i2c_args[3]) || (i > 127)) {
+      batch_used = SCAN_SIZE;
+      return 1;
+    }
+
+    if(i2c_probe(i, *(unsigned short*)i2c_args))
+      batch_buf[i >> 3] |= 1 << (i & 7);
+    i2c_args[2]++;
+    return 0;
+#endif
+
+#if CONFIG_RECOVER
+  case CMD_I2C_RECOVER:
+    i2c_recover(batch_buf);
+    status = STATUS_IDLE;
+    batch_used = 3;
+
+    DEBUGF("recover %x -> %x, %d clocks\n",
+	   batch_buf[0], batch_buf[1], batch_buf[2]);
+    break;
+#endif
+  }
+
+  return 1;
+}
+#endif
+
+static void i2c_poll(void) {
+  switch(i2c_state) {
+  case I2C_ADDRESS:
+    if(saved_cmd & CMD_I2C_BEGIN) 
+      i2c_start();
+    else 
+      i2c_repstart();    
+
+    // send DEVICE address
+    if(!i2c_put_u08(i2c_addr) || i2c_stretched) {
+      DEBUGF("I2C: address error @ %x\n", i2c_addr);
+
+      status = i2c_nak_status(STATUS_ADDRESS_NAK);
+      i2c_stop();
+      i2c_state = I2C_IDLE;
+      wb_fill = 0;
+      return;
+    }
+
     status = STATUS_ADDRESS_ACK;
-    expected = cmd->len;
-    saved_cmd = cmd->cmd;
+    i2c_state = I2C_DATA;
+    break;
+
+  case I2C_DATA:
+    if(i2c_addr & 1) {
+      /* refill the read ahead buffer once it has been consumed */
+      if(ahead_pos < ahead_len)
+	return;
+
+      ahead_pos = ahead_len = 0;
+      while(i2c_left && (ahead_len < READ_AHEAD)) {
+	uchar c;
+
+	i2c_left--;
+	c = i2c_get_u08(!i2c_left && !recv_len && !i2c_more);
+	ahead_buf[ahead_len++] = c;
+
+#if CONFIG_RECV_LEN
+	if(recv_len) {
+	  recv_len = 0;
+
+	  /* an invalid length still needs a NAKed byte to end the read, */
+	  /* the host rejects the length */
+	  if(!c || (c > I2C_SMBUS_BLOCK_MAX)) {
+	    i2c_get_u08(1);
+	    c = recv_extra = 0;
+	  }
+
+	  /* the usb transfer shrinks accordingly */
+	  i2c_left = c + recv_extra;
+	  expected = 1 + i2c_left;
+	}
+#endif
+      }
+
+      /* the data read is garbage once a client held the clock too long */
+      if(i2c_stretched) {
+	status = STATUS_TIMEOUT;
+	i2c_stop();
+	i2c_state = I2C_IDLE;
+	ahead_len = 0;
+	return;
+      }
+    } else if(wb_fill) {
+      /* write the oldest byte of the fifo to the bus, the rest of the */
+      /* message is dropped once the slave refuses a byte */
+      if((!i2c_put_u08(wb_get()) && !i2c_ignore_nak) || i2c_stretched) {
+	DEBUGF("write failed after %d bytes\n", i2c_acked);
+
+	status = i2c_nak_status(STATUS_DATA_NAK);
+	i2c_stop();
+	i2c_state = I2C_IDLE;
+	wb_fill = 0;
+	return;
+      }
+
+      i2c_acked++;
+      i2c_left--;
+    }
+    break;
+
+#if CONFIG_XFER_BATCH
+  case I2C_BATCH:
+    /* a segment reads as soon as its header is complete */
+    if(wb_fill) {
+      uchar c = wb_get();
+      batch_write(&c, 1);
+    } else if(!expected || (batch_seg == batch_segs))
+      i2c_state = I2C_IDLE;
+    return;
+#endif
+
+#if CONFIG_SMBUS
+  case I2C_SMBUS:
+    smbus_start();
+    i2c_state = I2C_PAYLOAD;
+    return;
+
+  case I2C_PAYLOAD:
+    if(wb_fill)
+      smbus_data(wb_get());
+    else if(!expected) {
+      smbus_end();
+      i2c_state = I2C_IDLE;
+    }
+    return;
+#endif
+
+#if CONFIG_COMMAND
+  case I2C_COMMAND:
+    if(i2c_command())
+      i2c_state = I2C_IDLE;
+    return;
+#endif
 
-    /* check if transfer is already done (or failed) */
-    if((cmd->cmd & CMD_I2C_END) && !expected) 
+  default:
+    return;
+  }
+
+  /* message complete, end transfer on last byte */
+  if(!i2c_left) {
+    if(saved_cmd & CMD_I2C_END)
       i2c_stop();
+
+    i2c_state = I2C_IDLE;
+  }
+}
+
+/* Tells whether the usb driver has to wait. Neither driver can NAK a     */
+/* packet from its callbacks, so the main loop holds them off instead: a */
+/* packet from the host waits for the address of a message, OUT data for */
+/* room in the fifo and the next request until the queued work is done.  */
+/* The IN packet of a read waits for its chunk of data. The driver NAKs  */
+/* the host meanwhile and runs on every pass otherwise.                  */
+#ifndef USBTINY
+extern volatile signed char usbRxLen;
+#define usb_rx_pending()  (usbRxLen > 0)
+#else
+extern byte_t usb_rx_len;
+#define usb_rx_pending()  (usb_rx_len)
+#endif
+
+static uchar i2c_busy(void) {
+  if(i2c_state == I2C_IDLE)
+    return 0;
+
+  if(usb_rx_pending())
+    return (i2c_state == I2C_ADDRESS) || !expected ||
+      (wb_fill > WRITE_FIFO-8);
+
+  return (i2c_state == I2C_DATA) && (i2c_addr & 1) &&
+    (ahead_pos == ahead_len);
+}
+
+/* Queue OUT data for the main loop, it's dropped once the message failed. */
+/* The main loop only polls the usb driver while there's room for it. */
+static void wb_queue(uchar *data, uchar len) {
+  if(len > expected) {
+    DEBUGF("exceeds!\n");
+    len = expected;
   }
 
+  expected -= len;
+  while(len--) {
+    DEBUGF("data = %x\n", *data);
+    if(i2c_state != I2C_IDLE)
+      wb_buf[(wb_tail + wb_fill++) & (WRITE_FIFO-1)] = *data;
+    data++;
+  }
+}
+
+#if CONFIG_COMMAND
+/* queue a command run by the main loop, its reply is fetched through */
+/* CMD_I2C_XFER_BATCH once it's done */
+static void i2c_queue(uchar *data) {
+  saved_cmd = data[1];
+  memcpy(i2c_args, data+2, sizeof(i2c_args));
+  memset(batch_buf, 0, BATCH_SIZE);
+  batch_used = 0;
+  expected = 0;
+  i2c_state = I2C_COMMAND;
+}
+#endif
+
+static uchar i2c_do(struct i2c_cmd *cmd) {
+  DEBUGF("i2c %s at 0x%02x, len = %d\n", 
+	   (cmd->flags&I2C_M_RD)?"rd":"wr", cmd->addr, cmd->len); 
+
+  saved_cmd = cmd->cmd;
+  expected = cmd->len;
+
+  /* the first message always begins with a start condition, as with */
+  /* i2c-algo-bit I2C_M_NOSTART is ignored there */
+  if(cmd->cmd & CMD_I2C_BEGIN)
+    cmd->flags &= ~I2C_M_NOSTART;
+
+  /* the last byte of an IN transfer carries the status */
+  if((cmd->cmd & CMD_I2C_STATUS) && (cmd->flags & I2C_M_RD) && expected)
+    expected--;
+
+  /* a failed message aborts the rest of the transaction */
+  if((((cmd->cmd & CMD_I2C_STATUS) && !(cmd->cmd & CMD_I2C_BEGIN)) ||
+      (cmd->flags & I2C_M_NOSTART)) && i2c_failed()) {
+    DEBUGF("transaction already failed\n");
+    goto done;
+  }
+
+  /* normal 7bit address */
+  i2c_addr = ( cmd->addr << 1 );
+  if (cmd->flags & I2C_M_RD )
+    i2c_addr |= 1;
+
+  /* the bus is accessed from the main loop */
+  i2c_left = expected;
+
+#if CONFIG_RECV_LEN
+  /* only the length byte is known to be read so far */
+  recv_len = (cmd->flags & I2C_M_RD) && (cmd->flags & I2C_M_RECV_LEN) &&
+    expected;
+  if(recv_len) {
+    recv_extra = (expected > 1 + I2C_SMBUS_BLOCK_MAX)?
+      expected - 1 - I2C_SMBUS_BLOCK_MAX:0;
+    i2c_left = 1;
+  }
+#endif
+
+  /* a continued message goes on without start and address */
+  i2c_more = (cmd->flags & I2C_M_MORE)?1:0;
+  i2c_ignore_nak = (cmd->flags & I2C_M_IGNORE_NAK)?1:0;
+  if(!(cmd->flags & I2C_M_NOSTART)) {
+    i2c_acked = 0;
+    i2c_select(cmd->addr);
+  }
+  i2c_state = (cmd->flags & I2C_M_NOSTART)?I2C_DATA:I2C_ADDRESS;
+
+ done:
   /* more data to be expected? */
 #ifndef USBTINY
   return(cmd->len?0xff:0x00);
@@ -374,6 +1588,104 @@ static uchar i2c_do(struct i2c_cmd *cmd) {
 #endif
 }
 
+#ifdef I2C_INT_EP
+#ifdef USBTINY
+#error "I2C_INT_EP is only supported with the avrusb driver"
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* The stream protocol runs batches over the interrupt endpoints. A frame    */
+/* sent to the OUT endpoint starts with the number of segments followed by   */
+/* the segments as in a batch transfer. Once the main loop has executed all  */
+/* segments the IN endpoint returns the length of the batch result and the   */
+/* result.                                                                   */
+
+/* interrupt-in and interrupt-out endpoint 1 besides the control endpoint */
+PROGMEM const char usbDescriptorConfiguration[] = {
+  9, USBDESCR_CONFIG, 9+9+7+7, 0,  // length, type, total length
+  1, 1, 0,                         // interfaces, index, name string
+  (1 << 7), USB_CFG_MAX_BUS_POWER/2,
+  9, USBDESCR_INTERFACE, 0, 0, 2,  // length, type, index, alt, endpoints
+  USB_CFG_INTERFACE_CLASS, USB_CFG_INTERFACE_SUBCLASS,
+  USB_CFG_INTERFACE_PROTOCOL, 0,
+  7, USBDESCR_ENDPOINT, (char)0x81, 0x03, 8, 0, USB_CFG_INTR_POLL_INTERVAL,
+  7, USBDESCR_ENDPOINT,       0x01, 0x03, 8, 0, USB_CFG_INTR_POLL_INTERVAL,
+};
+
+#define STREAM_IDLE   0
+#define STREAM_RX     1  // receiving a frame
+#define STREAM_TX     2  // returning the result
+
+static uchar stream_state, stream_tx;
+
+void usbFunctionWriteOut(uchar *data, uchar len) {
+  /* a new frame also drops an unfinished reply */
+  if(stream_state != STREAM_RX) {
+    if(!len) return;
+
+    batch_begin(*data++);
+    len--;
+    stream_state = STREAM_RX;
+
+    /* the length is unknown, the frame ends with its last segment */
+    i2c_state = I2C_BATCH;
+    wb_fill = 0;
+    expected = 0xffff;
+  }
+
+  wb_queue(data, len);
+}
+
+/* called from the main loop, queue the next packet of the reply */
+static void stream_poll(void) {
+  uchar buf[8], i;
+
+  if((stream_state == STREAM_RX) && (i2c_state == I2C_IDLE)) {
+    stream_state = STREAM_TX;
+    stream_tx = 0;
+  }
+
+  if((stream_state != STREAM_TX) || !usbInterruptIsReady())
+    return;
+
+  for(i=0;(i<sizeof(buf)) && (stream_tx <= batch_used);i++,stream_tx++)
+    buf[i] = stream_tx?batch_buf[stream_tx-1]:batch_used;
+
+  usbSetInterrupt(buf, i);
+
+  if(stream_tx > batch_used)
+    stream_state = STREAM_IDLE;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* CMD_GET_CAPS describes the firmware in one request. All values are     */
+/* little endian, later versions only append fields.                      */
+#define CAPS_VERSION 1
+
+/* longest message of a single control transfer, neither usb stack is */
+/* built with long transfers. A read leaves room for the status byte. */
+#define MAX_READ   254
+#define MAX_WRITE  255
+
+struct caps {
+  uchar length;                  // size of this descriptor
+  uchar version;                 // CAPS_VERSION
+  unsigned long func;            // as returned by CMD_GET_FUNC
+  unsigned long features;        // as returned by CMD_GET_FEATURES
+  unsigned short max_read;       // longest read message
+  unsigned short max_write;      // longest write message
+  unsigned short batch_size;     // result buffer of a batch transfer
+  unsigned short write_fifo;     // write data buffered ahead of the bus
+  unsigned short min_delay;      // range of CMD_SET_DELAY in us
+  unsigned short max_delay;
+};
+
+static const struct caps caps PROGMEM = {
+  sizeof(struct caps), CAPS_VERSION, FUNC, FEATURES,
+  MAX_READ, MAX_WRITE, BATCH_SIZE, WRITE_FIFO, MIN_DELAY, MAX_DELAY
+};
+
 #ifndef USBTINY
 uchar	usbFunctionSetup(uchar data[8]) {
   static uchar replyBuf[4];
@@ -386,6 +1698,20 @@ extern	byte_t	usb_setup ( byte_t data[8] )
 
   DEBUGF("Setup %x %x %x %x\n", data[0], data[1], data[2], data[3]);
 
+  /* A request is only taken once queued work is done, so GET_STATUS */
+  /* reports the result of queued writes. A new request ends any      */
+  /* message in progress. */
+  i2c_state = I2C_IDLE;
+  ahead_pos = ahead_len = 0;
+#if CONFIG_RECV_LEN
+  recv_len = 0;
+#endif
+  wb_fill = 0;
+
+#ifdef I2C_INT_EP
+  stream_state = STREAM_IDLE;
+#endif
+
   switch(data[1]) {
 
   case CMD_ECHO: // echo (for transfer reliability testing)
@@ -395,37 +1721,142 @@ extern	byte_t	usb_setup ( byte_t data[8] )
     break;
 
   case CMD_GET_FUNC:
-    memcpy_P(replyBuf, &func, sizeof(func));
-    return sizeof(func);
+    memcpy_P(replyBuf, &caps.func, sizeof(caps.func));
+    return sizeof(caps.func);
     break;
 
   case CMD_SET_DELAY:
-    /* The delay function used delays 4 system ticks per cycle. */
-    /* This gives 1/3us at 12Mhz per cycle. The delay function is */
-    /* called twice per clock edge and thus four times per full cycle. */ 
-    /* Thus it is called one time per edge with the full delay */ 
-    /* value and one time with the half one. Resulting in */
-    /* 2 * n * 1/3 + 2 * 1/2 n * 1/3 = n us. */
-    clock_delay = *(unsigned short*)(data+2);
-    if(!clock_delay) clock_delay = 1;
-    clock_delay2 = clock_delay/2;
-    if(!clock_delay2) clock_delay2 = 1;
-
-    DEBUGF("request for delay %dus\n", clock_delay); 
+    /* the delay is the period of the i2c clock in us */
+    bus_delay = *(unsigned short*)(data+2);
+    i2c_use_delay(bus_delay);
+
+    DEBUGF("request for delay %dus\n", *(unsigned short*)(data+2));
+    break;
+
+  case CMD_SET_STRETCH:
+    /* the longest time a client may hold SCL low in ms */
+    i2c_set_stretch(*(unsigned short*)(data+2));
     break;
 
   case CMD_I2C_IO:
   case CMD_I2C_IO + CMD_I2C_BEGIN:
   case CMD_I2C_IO                 + CMD_I2C_END:
   case CMD_I2C_IO + CMD_I2C_BEGIN + CMD_I2C_END:
+  case CMD_I2C_IO                                 + CMD_I2C_STATUS:
+  case CMD_I2C_IO + CMD_I2C_BEGIN                 + CMD_I2C_STATUS:
+  case CMD_I2C_IO                 + CMD_I2C_END   + CMD_I2C_STATUS:
+  case CMD_I2C_IO + CMD_I2C_BEGIN + CMD_I2C_END   + CMD_I2C_STATUS:
     // these are only allowed as class transfers
 
     return i2c_do((struct i2c_cmd*)data);
     break;
 
+  case CMD_GET_FEATURES:
+    memcpy_P(replyBuf, &caps.features, sizeof(caps.features));
+    return sizeof(caps.features);
+    break;
+
+  case CMD_GET_CAPS:
+    /* too long for the reply buffer, sent by usbFunctionRead() */
+    saved_cmd = CMD_GET_CAPS;
+    expected = sizeof(caps);
+    return 0xff;
+    break;
+
+#if CONFIG_XFER_BATCH || CONFIG_SMBUS || CONFIG_COMMAND
+  case CMD_I2C_XFER_BATCH:
+    saved_cmd = CMD_I2C_XFER_BATCH;
+
+    if(data[0] & 0x80) {
+      /* return the results of the last batch, SMBus or other command */
+      expected = batch_used;
+      return 0xff;
+    }
+
+#if CONFIG_XFER_BATCH
+    batch_begin(data[2]);
+    expected = *(unsigned short*)(data+6);
+    i2c_state = I2C_BATCH;
+#ifndef USBTINY
+    return 0xff;
+#else
+    return 0;
+#endif
+#endif
+    break;
+#endif
+
+#if CONFIG_WAIT_ACK
+  case CMD_I2C_WAIT_ACK:
+    /* wValue is the address, wIndex the timeout in ms. The reply holds */
+    /* the status and the time it took. */
+    i2c_queue(data);
+    job_begin(*(unsigned short*)(data+4));
+    break;
+#endif
+
+#if CONFIG_POLL_REG
+  case CMD_SET_POLL:
+    /* wValue is the poll interval, wIndex the timeout in ms */
+    poll_interval = *(unsigned short*)(data+2);
+    poll_timeout = *(unsigned short*)(data+4);
+    if(poll_interval > 1000) poll_interval = 1000;
+    break;
+
+  case CMD_I2C_POLL_REG:
+    /* wValue carries address and register, wIndex mask and value */
+    i2c_queue(data);
+    job_begin(poll_timeout);
+    poll_next = 0;
+    break;
+#endif
+
+#if CONFIG_SCAN
+  case CMD_I2C_SCAN:
+    /* wIndex holds the first and the last address, wValue selects read */
+    /* probes per block of 8 addresses */
+    i2c_queue(data);
+    break;
+#endif
+
+#if CONFIG_SMBUS
+  case CMD_I2C_SMBUS:
+    saved_cmd = CMD_I2C_SMBUS;
+    smbus_setup(data);
+    i2c_state = I2C_SMBUS;
+
+    /* the payload completes the write phase */
+    if((expected = *(unsigned short*)(data+6)))
+#ifndef USBTINY
+      return 0xff;
+#else
+      return 0;
+#endif
+    break;
+#endif
+
+#if CONFIG_SPEED
+  case CMD_SET_SPEED:
+    /* wValue is the delay used for the client in wIndex, 0 to remove */
+    /* it. The reply is 0 if there's no free slot left. */
+    replyBuf[0] = i2c_set_speed(data[4], *(unsigned short*)(data+2));
+    return 1;
+    break;
+#endif
+
+#if CONFIG_RECOVER
+  case CMD_I2C_RECOVER:
+    /* line states before and after, bit 0 is SDA and bit 1 SCL */
+    i2c_queue(data);
+    break;
+#endif
+
   case CMD_GET_STATUS:
+    /* the number of bytes written before a data NAK comes along */
     replyBuf[0] = status;
-    return 1;
+    replyBuf[1] = i2c_acked & 0xff;
+    replyBuf[2] = i2c_acked >> 8;
+    return 3;
     break;
 
   default:
@@ -447,32 +1878,61 @@ uchar usbFunctionRead( uchar *data, uchar len )
 extern	byte_t	usb_in ( byte_t* data, byte_t len )
 #endif
 {
-  uchar i;
+  uchar i, max = len;
 
   DEBUGF("read %d bytes, %d exp\n", len, expected);
 
-  if(status == STATUS_ADDRESS_ACK) {
-    if(len > expected) {
-      DEBUGF("exceeds!\n");
-      len = expected;
-    }
+  /* Both usb drivers ask for the first IN packet in the same poll as */
+  /* the setup request. The address and the first chunk of a read are */
+  /* clocked here for it, that's two steps of the state machine. The  */
+  /* results of other commands are only fetched once they're done.    */
+  if(ahead_pos == ahead_len) {
+    if(i2c_state == I2C_ADDRESS)
+      i2c_poll();
+    i2c_poll();
+  }
 
-    // consume bytes
-    for(i=0;i<len;i++) {
-      expected--;
-      *data = i2c_get_u08(expected == 0);
-      DEBUGF("data = %x\n", *data);
-      data++;
-    }
+  if(len > expected) {
+    DEBUGF("exceeds!\n");
+    len = expected;
+  }
 
-    // end transfer on last byte
-    if((saved_cmd & CMD_I2C_END) && !expected) 
-      i2c_stop();
+  if(saved_cmd == CMD_GET_CAPS) {
+    memcpy_P(data, (uchar*)&caps + sizeof(caps) - expected, len);
+    expected -= len;
+    return len;
+  }
 
-  } else {
-    DEBUGF("not in ack state\n");
-    memset(data, 0, len);
+  if(saved_cmd == CMD_I2C_XFER_BATCH) {
+    memcpy(data, batch_buf + batch_used - expected, len);
+    expected -= len;
+    return len;
   }
+
+  // an unacknowledged address or a failed earlier message ends the
+  // transfer early with just the status instead of dummy data
+  if(i2c_failed())
+    expected = 0;
+
+  // consume bytes, a length byte read may have shrunk the transfer
+  for(i=0;(i<len) && expected;i++) {
+    if(ahead_pos < ahead_len)
+      *data = ahead_buf[ahead_pos++];
+    else
+      *data = 0;
+    expected--;
+    DEBUGF("data = %x\n", *data);
+    data++;
+  }
+  len = i;
+
+  // append status once all data has been sent
+  if((saved_cmd & CMD_I2C_STATUS) && !expected && (len < max)) {
+    *data = status;
+    saved_cmd &= ~CMD_I2C_STATUS;
+    len++;
+  }
+
   return len;
 }
 
@@ -486,37 +1946,20 @@ uchar usbFunctionWrite( uchar *data, uchar len )
 extern	void	usb_out ( byte_t* data, byte_t len )
 #endif
 {
-  uchar i, err=0;
-
   DEBUGF("write %d bytes, %d exp\n", len, expected);
 
-  if(status == STATUS_ADDRESS_ACK) {
-    if(len > expected) {
-      DEBUGF("exceeds!\n");
-      len = expected;
-    }
-
-    // consume bytes
-    for(i=0;i<len;i++) {
-      expected--;
-      DEBUGF("data = %x\n", *data);
-      if(!i2c_put_u08(*data++))
-	err = 1;
-    }
-
-    // end transfer on last byte
-    if((saved_cmd & CMD_I2C_END) && !expected) 
-      i2c_stop();
-
-    if(err) {
-      DEBUGF("write failed\n");
-      //TODO: set status
-    }
-
-  } else {
-    DEBUGF("not in ack state\n");
-    memset(data, 0, len);
+#ifndef USBTINY
+  // the main loop sends the address before the data is taken, the data
+  // stage is stalled if it isn't acknowledged or the slave refused data
+  // already (usbtiny cannot stall an OUT transfer)
+  if((saved_cmd != CMD_I2C_SMBUS) && (saved_cmd != CMD_I2C_XFER_BATCH) &&
+     i2c_failed()) {
+    expected = 0;
+    return 0xff;
   }
+#endif
+
+  wb_queue(data, len);
 
 #ifndef USBTINY
   return len;
@@ -547,9 +1990,18 @@ int	main(void) {
   DEBUGF("i2c-tiny-usb - (c) 2006 by Till Harbaum\n");
 
   i2c_init();
+  timer_init();
 
-#ifdef DEBUG
-  i2c_scan();
+#if defined(DEBUG) && CONFIG_SCAN
+  {
+    uchar i;
+
+    for(i=0;i<128;i++) {
+      wdt_reset();
+      if(i2c_probe(i, 0))
+	DEBUGF("I2C device at address 0x%x\n", i);
+    }
+  }
 #endif
 
   /* clear usb ports */
@@ -569,7 +2021,18 @@ int	main(void) {
   sei();
   for(;;) {	/* main event loop */
     wdt_reset();
-    usbPoll();
+
+    /* the driver NAKs the host while a packet waits for the bus */
+    if(!i2c_busy())
+      usbPoll();
+
+    /* advance the i2c bus state machine, e.g. prepare the next IN */
+    /* packet while the current one is sent */
+    i2c_poll();
+
+#ifdef I2C_INT_EP
+    stream_poll();
+#endif
   }
 
   return 0;
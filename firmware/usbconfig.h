@@ -48,14 +48,33 @@ must be adapted to your hardware.
 
 /* --------------------------- Functional Range ---------------------------- */
 
+#ifdef I2C_INT_EP
+#define	USB_CFG_HAVE_INTRIN_ENDPOINT	1
+#else
 #define	USB_CFG_HAVE_INTRIN_ENDPOINT	0
+#endif
 /* Define this to 1 if you want to compile a version with two endpoints: The
- * default control endpoint 0 and an interrupt-in endpoint 1.
+ * default control endpoint 0 and an interrupt-in endpoint 1. I2C_INT_EP
+ * enables this together with an interrupt-out endpoint 1 for the stream
+ * protocol.
  */
+#ifdef I2C_INT_EP
+#define	USB_CFG_INTR_POLL_INTERVAL		1
+#else
 #define	USB_CFG_INTR_POLL_INTERVAL		10
+#endif
 /* If you compile a version with endpoint 1 (interrupt-in), this is the poll
  * interval. The value is in milliseconds and must not be less than 10 ms for
- * low speed devices.
+ * low speed devices. The stream protocol asks for 1 ms anyway, Linux polls
+ * low speed interrupt endpoints at the requested rate.
+ */
+#ifdef I2C_INT_EP
+#define USB_CFG_IMPLEMENT_FN_WRITEOUT	1
+#define USB_CFG_DESCR_PROPS_CONFIGURATION	USB_PROP_LENGTH(9+9+7+7)
+#endif
+/* The data sent to the interrupt-out endpoint is passed to
+ * usbFunctionWriteOut(). The configuration descriptor listing both
+ * endpoints is supplied by main.c.
  */
 #define	USB_CFG_IS_SELF_POWERED			0
 /* Define this to 1 if the device has its own power supply. Set it to 0 if the
@@ -13,6 +13,10 @@
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/module.h>
+#include <linux/completion.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/jiffies.h>
 
 /* include interfaces to usb layer */
 #include <linux/usb.h>
@@ -29,6 +33,66 @@
 #define CMD_I2C_IO		4
 #define CMD_I2C_IO_BEGIN	(1<<0)
 #define CMD_I2C_IO_END		(1<<1)
+#define CMD_I2C_IO_STATUS	(1<<3)
+
+#define CMD_GET_FEATURES	16
+#define CMD_I2C_XFER_BATCH	17
+#define CMD_I2C_WAIT_ACK	18
+#define CMD_I2C_POLL_REG	19
+#define CMD_I2C_SCAN		20
+#define CMD_I2C_SMBUS		21
+#define CMD_GET_CAPS		22
+#define CMD_SET_STRETCH		23
+#define CMD_I2C_RECOVER		24
+#define CMD_SET_SPEED		25
+#define CMD_SET_POLL		26
+
+/* protocol extensions reported by CMD_GET_FEATURES */
+#define FEATURE_INLINE_STATUS	(1<<0)
+#define FEATURE_XFER_BATCH	(1<<1)
+#define FEATURE_INT_EP		(1<<2)
+#define FEATURE_WAIT_ACK	(1<<3)
+#define FEATURE_POLL_REG	(1<<4)
+#define FEATURE_SCAN		(1<<5)
+#define FEATURE_SMBUS		(1<<6)
+#define FEATURE_CHUNK		(1<<7)
+#define FEATURE_STRETCH		(1<<8)
+#define FEATURE_RECOVER		(1<<9)
+#define FEATURE_SPEED		(1<<10)
+
+/* CMD_I2C_IO flag in wValue next to the i2c message flags, the */
+/* message continues in the next request and its last byte read is */
+/* acknowledged, the next request comes with I2C_M_NOSTART */
+#define I2C_TINY_USB_M_MORE	0x0100
+
+/* smallest batch result buffer of all firmware variants */
+#define BATCH_SIZE		32
+
+/* message limits of firmware without CMD_GET_CAPS, a control transfer */
+/* carries at most 255 bytes including the status of inline reads */
+#define MAX_READ		254
+#define MAX_WRITE		255
+
+/* capability descriptor returned by CMD_GET_CAPS, later versions */
+/* only append fields */
+struct i2c_tiny_usb_caps {
+	u8 length;
+	u8 version;
+	__le32 func;		/* as returned by CMD_GET_FUNC */
+	__le32 features;	/* as returned by CMD_GET_FEATURES */
+	__le16 max_read;	/* longest read message */
+	__le16 max_write;	/* longest write message */
+	__le16 batch_size;	/* result buffer of a batch transfer */
+	__le16 write_fifo;	/* write data buffered ahead of the bus */
+	__le16 min_delay;	/* range of CMD_SET_DELAY in us */
+	__le16 max_delay;
+} __packed;
+
+/* control requests queued at once, messages plus a status request */
+#define ASYNC_URBS		8
+
+/* queued requests must not share cache lines of their buffers */
+#define ASYNC_BUF(len)		ALIGN(len, L1_CACHE_BYTES)
 
 /* i2c bit delay, default is 10us -> 100kHz */
 static int delay = 10;
@@ -36,26 +100,249 @@ module_param(delay, int, 0);
 MODULE_PARM_DESC(delay, "bit delay in microseconds, "
 		 "e.g. 10 for 100kHz (default is 100kHz)");
 
+/* wait for eeprom write cycles on the device */
+static int wait_ack = 25;
+module_param(wait_ack, int, 0644);
+MODULE_PARM_DESC(wait_ack, "time in ms the device polls a slave which "
+		 "doesn't respond after being written to, 0 to disable "
+		 "(default is 25ms)");
+
+/* answer address probes from a scan of the whole bus on the device */
+static int scan_cache = 1000;
+module_param(scan_cache, int, 0644);
+MODULE_PARM_DESC(scan_cache, "time in ms the result of a bus scan is used "
+		 "for zero length read probes, 0 to disable "
+		 "(default is 1000ms)");
+
+/* give up on clients holding SCL low for too long, the firmware keeps */
+/* the longest wait well below its watchdog timeout */
+#define STRETCH_MIN		1
+#define STRETCH_MAX		250
+
+static int stretch_timeout = 25;
+module_param(stretch_timeout, int, 0);
+MODULE_PARM_DESC(stretch_timeout, "time in milliseconds a slave may stretch "
+		 "the clock before the transfer fails with a timeout, 1 to "
+		 "250 (default is 25ms)");
+
+/* range of the scan, the reserved addresses are probed individually */
+#define SCAN_FIRST		0x08
+#define SCAN_LAST		0x77
+
 static int usb_read(struct i2c_adapter *adapter, int cmd,
 		    int value, int index, void *data, int len);
 
 static int usb_write(struct i2c_adapter *adapter, int cmd,
 		     int value, int index, void *data, int len);
 
+static int usb_xfer_async(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			  int num);
+
+static int usb_xfer_stream(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			   int num);
+
 /* ----- begin of i2c layer ---------------------------------------------- */
 
 #define STATUS_IDLE		0
 #define STATUS_ADDRESS_ACK	1
 #define STATUS_ADDRESS_NAK	2
+#define STATUS_PEC_ERROR	3
+#define STATUS_DATA_NAK		4
+#define STATUS_TIMEOUT		5
 
-static int usb_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs, int num)
+/* flags of CMD_I2C_SMBUS in the high byte of wValue */
+#define SMBUS_CMD		(1<<0)	/* send the command byte */
+#define SMBUS_DATA		(1<<1)	/* send the data byte */
+#define SMBUS_READ		(1<<2)	/* read phase */
+#define SMBUS_BLOCK		(1<<3)	/* first byte read is the block length */
+#define SMBUS_PEC		(1<<4)	/* append or check a packet error code */
+
+static u32 usb_func(struct i2c_adapter *adapter);
+static u32 usb_features(struct i2c_adapter *adapter);
+static int usb_batch_size(struct i2c_adapter *adapter);
+static int usb_max_write(struct i2c_adapter *adapter);
+static int usb_wait_ack(struct i2c_adapter *adapter, int addr);
+static void usb_write_done(struct i2c_adapter *adapter, int addr);
+static int usb_scan_probe(struct i2c_adapter *adapter, int addr);
+static int usb_get_status(struct i2c_adapter *adapter, int *acked);
+
+/* the length of a block read is only known once its first byte has */
+/* been read, only the synchronous path handles that */
+static int usb_recv_len(struct i2c_msg *msgs, int num)
 {
-	unsigned char status;
-	struct i2c_msg *pmsg;
 	int i;
 
+	for (i = 0 ; i < num ; i++)
+		if ((msgs[i].flags & I2C_M_RD) &&
+		    (msgs[i].flags & I2C_M_RECV_LEN))
+			return 1;
+
+	return 0;
+}
+
+/* check if a combined transaction fits into a single batch transfer */
+static int usb_batch_possible(struct i2c_adapter *adapter,
+			      struct i2c_msg *msgs, int num)
+{
+	int i, rlen = num, len = 0;
+
+	for (i = 0 ; i < num ; i++) {
+		/* the segment header has no room for I2C_M_IGNORE_NAK */
+		if ((msgs[i].len > 255) ||
+		    (msgs[i].flags & I2C_M_IGNORE_NAK))
+			return 0;
+
+		len += 3;
+		if (msgs[i].flags & I2C_M_RD)
+			rlen += msgs[i].len;
+		else
+			len += msgs[i].len;
+	}
+
+	return (rlen <= usb_batch_size(adapter)) &&
+		(len <= usb_max_write(adapter));
+}
+
+/* serialize the segments of a batch, returns the length of the result */
+static int usb_batch_pack(struct i2c_msg *msgs, int num, unsigned char *p)
+{
+	int i, rlen = num;
+
+	for (i = 0 ; i < num ; i++) {
+		*p++ = msgs[i].flags & I2C_M_RD;
+		*p++ = msgs[i].addr;
+		*p++ = msgs[i].len;
+
+		if (msgs[i].flags & I2C_M_RD) {
+			rlen += msgs[i].len;
+		} else {
+			memcpy(p, msgs[i].buf, msgs[i].len);
+			p += msgs[i].len;
+		}
+	}
+
+	return rlen;
+}
+
+/* status of a message which made the firmware abort the transfer */
+static int usb_status_failed(int status)
+{
+	return (status == STATUS_ADDRESS_NAK) ||
+		(status == STATUS_DATA_NAK) ||
+		(status == STATUS_TIMEOUT);
+}
+
+/* error code of a failure status, a missing address acknowledge of */
+/* the first message means there is no such device */
+static int usb_status_error(int status, int first)
+{
+	switch (status) {
+	case STATUS_PEC_ERROR:
+		return -EBADMSG;
+	case STATUS_DATA_NAK:
+		return -EIO;
+	case STATUS_TIMEOUT:
+		return -ETIMEDOUT;
+	}
+
+	return first ? -ENXIO : -EREMOTEIO;
+}
+
+/* per segment status followed by the read data */
+static int usb_batch_result(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			    int num, unsigned char *buf)
+{
+	unsigned char *p;
+	int i;
+
+	for (p = buf + num, i = 0 ; i < num ; i++) {
+		dev_dbg(&adapter->dev, "  %d: status = %d\n", i, buf[i]);
+		if (buf[i] != STATUS_ADDRESS_ACK)
+			return usb_status_error(buf[i], i == 0);
+
+		if (msgs[i].flags & I2C_M_RD) {
+			memcpy(msgs[i].buf, p, msgs[i].len);
+			p += msgs[i].len;
+		}
+	}
+
+	return num;
+}
+
+/* length of the OUT stage of a batch */
+static int usb_batch_len(struct i2c_msg *msgs, int num)
+{
+	int i, len = 0;
+
+	for (i = 0 ; i < num ; i++) {
+		len += 3;
+		if (!(msgs[i].flags & I2C_M_RD))
+			len += msgs[i].len;
+	}
+
+	return len;
+}
+
+/* run all messages on the device with one OUT and one IN transfer */
+static int usb_xfer_batch(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			  int num)
+{
+	unsigned char *buf;
+	int len, rlen;
+	int ret;
+
+	len = usb_batch_len(msgs, num);
+
+	buf = kmalloc(max(len, usb_batch_size(adapter)), GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	rlen = usb_batch_pack(msgs, num, buf);
+
+	if (usb_write(adapter, CMD_I2C_XFER_BATCH, num, 0, buf, len) != len) {
+		dev_err(&adapter->dev, "failure writing batch\n");
+		ret = -EREMOTEIO;
+		goto out;
+	}
+
+	if (usb_read(adapter, CMD_I2C_XFER_BATCH, num, 0, buf, rlen) != rlen) {
+		dev_err(&adapter->dev, "failure reading batch result\n");
+		ret = -EREMOTEIO;
+		goto out;
+	}
+
+	ret = usb_batch_result(adapter, msgs, num, buf);
+
+ out:
+	kfree(buf);
+	return ret;
+}
+
+/* run the messages, -ENXIO if the first address wasn't acknowledged */
+static int usb_xfer_msgs(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			 int num)
+{
+	struct i2c_msg *pmsg;
+	int i, len, status, acked, recv_len = usb_recv_len(msgs, num);
+
 	dev_dbg(&adapter->dev, "master xfer %d messages:\n", num);
 
+	/* the interrupt endpoints avoid the control transfer overhead */
+	if (!recv_len && (usb_features(adapter) & FEATURE_INT_EP) &&
+	    usb_batch_possible(adapter, msgs, num))
+		return usb_xfer_stream(adapter, msgs, num);
+
+	/* combined transactions are cheapest when run on the device */
+	if (!recv_len && (num > 1) &&
+	    (usb_features(adapter) & FEATURE_XFER_BATCH) &&
+	    usb_batch_possible(adapter, msgs, num))
+		return usb_xfer_batch(adapter, msgs, num);
+
+	/* with inline status a failed message makes the firmware skip */
+	/* all following ones, so they can be queued without waiting */
+	if (!recv_len && (usb_features(adapter) & FEATURE_INLINE_STATUS))
+		return usb_xfer_async(adapter, msgs, num);
+
 	for (i = 0 ; i < num ; i++) {
 		int cmd = CMD_I2C_IO;
 
@@ -72,58 +359,282 @@ static int usb_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs, int num)
 			i, pmsg->flags & I2C_M_RD ? "read" : "write", 
 			pmsg->flags, pmsg->len, pmsg->addr);
 
-		/* and directly send the message */
-		if (pmsg->flags & I2C_M_RD) {
+		/* and directly send the message, the device ends the */
+		/* data stage early if the address isn't acknowledged */
+		if (pmsg->flags & I2C_M_RECV_LEN) {
+			/* the device reads the length byte and as many */
+			/* bytes as it says in addition to the others */
+			len = usb_read(adapter, cmd, pmsg->flags,
+				       pmsg->addr, pmsg->buf,
+				       pmsg->len + I2C_SMBUS_BLOCK_MAX);
+		} else if (pmsg->flags & I2C_M_RD) {
 			/* read data */
-			if (usb_read(adapter, cmd,
-				     pmsg->flags, pmsg->addr,
-				     pmsg->buf, pmsg->len) != pmsg->len) {
-				dev_err(&adapter->dev, 
-					"failure reading data\n");
-				return -EREMOTEIO;
-			}
+			len = usb_read(adapter, cmd, pmsg->flags, pmsg->addr,
+				       pmsg->buf, pmsg->len);
 		} else {
 			/* write data */
-			if (usb_write(adapter, cmd,
-				      pmsg->flags, pmsg->addr,
-				      pmsg->buf, pmsg->len) != pmsg->len) {
-				dev_err(&adapter->dev, 
-					"failure writing data\n");
-				return -EREMOTEIO;
-			}
+			len = usb_write(adapter, cmd, pmsg->flags, pmsg->addr,
+					pmsg->buf, pmsg->len);
 		}
 
 		/* read status */
-		if (usb_read(adapter, CMD_GET_STATUS, 0, 0, &status, 1) != 1) {
+		status = usb_get_status(adapter, &acked);
+		if (status < 0) {
 			dev_err(&adapter->dev, "failure reading status\n");
 			return -EREMOTEIO;
 		}
 
 		dev_dbg(&adapter->dev, "  status = %d\n", status);
-		if (status == STATUS_ADDRESS_NAK)
+		if (status == STATUS_DATA_NAK)
+			dev_dbg(&adapter->dev, "  %d: byte %d not acked\n",
+				i, acked);
+
+		if (usb_status_failed(status))
+			return usb_status_error(status, i == 0);
+
+		if ((pmsg->flags & I2C_M_RECV_LEN) ? (len < pmsg->len) :
+		    (len != pmsg->len)) {
+			dev_err(&adapter->dev, "failure %s data\n",
+				pmsg->flags & I2C_M_RD ? "reading" : "writing");
 			return -EREMOTEIO;
+		}
+
+		if (pmsg->flags & I2C_M_RECV_LEN) {
+			if ((pmsg->buf[0] < 1) ||
+			    (pmsg->buf[0] > I2C_SMBUS_BLOCK_MAX) ||
+			    (len != pmsg->len + pmsg->buf[0])) {
+				dev_err(&adapter->dev,
+					"invalid block length %d\n",
+					pmsg->buf[0]);
+				return -EPROTO;
+			}
+
+			pmsg->len += pmsg->buf[0];
+		}
 	}
 
 	return i;
 }
 
-static u32 usb_func(struct i2c_adapter *adapter)
+static int usb_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs, int num)
 {
-	u32 func;
+	int ret;
 
-	/* get functionality from adapter */
-	if (usb_read(adapter, CMD_GET_FUNC, 0, 0, &func, sizeof(func)) !=
-	    sizeof(func)) {
-		dev_err(&adapter->dev, "failure reading functionality\n");
-		return 0;
+	/* i2cdetect and sensors-detect probe one address after the other, */
+	/* a zero length write may be a command and always goes to the bus */
+	if ((num == 1) && !msgs[0].len && (msgs[0].flags & I2C_M_RD)) {
+		ret = usb_scan_probe(adapter, msgs[0].addr);
+		if (ret >= 0)
+			return ret ? 1 : -ENXIO;
 	}
 
-	return func;
+	ret = usb_xfer_msgs(adapter, msgs, num);
+
+	/* an eeprom doesn't answer during its write cycle, let the device */
+	/* poll it instead of failing and having the caller retry */
+	if ((ret == -ENXIO) && usb_wait_ack(adapter, msgs[0].addr))
+		ret = usb_xfer_msgs(adapter, msgs, num);
+
+	usb_write_done(adapter, ((ret == num) &&
+				 !(msgs[num-1].flags & I2C_M_RD)) ?
+		       msgs[num-1].addr : -1);
+
+	/* a client stretching the clock forever may as well hold SDA low */
+	if ((ret == -ETIMEDOUT) && adapter->bus_recovery_info)
+		i2c_recover_bus(adapter);
+
+	return ret;
+}
+
+/* map a SMBus transaction to the write and read phase of CMD_I2C_SMBUS, */
+/* -ENXIO if the address wasn't acknowledged */
+static int usb_smbus_run(struct i2c_adapter *adapter, u16 addr,
+			 unsigned short flags, char read_write, u8 command,
+			 int size, union i2c_smbus_data *data)
+{
+	int rd = (read_write == I2C_SMBUS_READ);
+	int smflags = 0, wlen = 0, rlen = 0, len, ret;
+	unsigned char *buf;
+
+	buf = kmalloc(I2C_SMBUS_BLOCK_MAX + 2, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	switch (size) {
+	case I2C_SMBUS_QUICK:
+		smflags = rd ? SMBUS_READ : 0;
+		break;
+	case I2C_SMBUS_BYTE:
+		smflags = rd ? SMBUS_READ : SMBUS_CMD;
+		rlen = rd;
+		break;
+	case I2C_SMBUS_BYTE_DATA:
+		smflags = SMBUS_CMD | (rd ? SMBUS_READ : SMBUS_DATA);
+		rlen = rd;
+		break;
+	case I2C_SMBUS_WORD_DATA:
+	case I2C_SMBUS_PROC_CALL:
+		smflags = SMBUS_CMD;
+		if (rd || (size == I2C_SMBUS_PROC_CALL)) {
+			smflags |= SMBUS_READ;
+			rlen = 2;
+		}
+		if (!rd) {
+			buf[0] = data->word & 0xff;
+			buf[1] = data->word >> 8;
+			wlen = 2;
+		}
+		break;
+	case I2C_SMBUS_BLOCK_DATA:
+	case I2C_SMBUS_BLOCK_PROC_CALL:
+		smflags = SMBUS_CMD;
+		if (rd || (size == I2C_SMBUS_BLOCK_PROC_CALL)) {
+			smflags |= SMBUS_READ | SMBUS_BLOCK;
+			rlen = I2C_SMBUS_BLOCK_MAX;
+		}
+		if (!rd) {
+			wlen = data->block[0] + 1;
+			if ((wlen < 2) || (wlen > I2C_SMBUS_BLOCK_MAX + 1)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			memcpy(buf, data->block, wlen);
+		}
+		break;
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+		smflags = SMBUS_CMD;
+		len = data->block[0];
+		if ((len < 1) || (len > I2C_SMBUS_BLOCK_MAX)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (rd) {
+			smflags |= SMBUS_READ;
+			rlen = len;
+		} else {
+			memcpy(buf, data->block + 1, len);
+			wlen = len;
+		}
+		break;
+	default:
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if ((flags & I2C_CLIENT_PEC) && (size != I2C_SMBUS_QUICK) &&
+	    (size != I2C_SMBUS_I2C_BLOCK_DATA))
+		smflags |= SMBUS_PEC;
+
+	dev_dbg(&adapter->dev, "smbus %s size %d at 0x%02x, cmd 0x%02x\n",
+		rd ? "read" : "write", size, addr, command);
+
+	/* the result is a status byte followed by the read data */
+	len = 1 + rlen + ((smflags & SMBUS_BLOCK) ? 1 : 0);
+
+	/* the device runs the transaction after the OUT stage with the */
+	/* payload, the result is fetched like that of a batch */
+	if (usb_write(adapter, CMD_I2C_SMBUS, addr | (smflags << 8),
+		      command | ((smflags & SMBUS_DATA) ?
+				 data->byte : rlen) << 8,
+		      wlen ? buf : NULL, wlen) != wlen) {
+		dev_err(&adapter->dev, "failure writing smbus data\n");
+		ret = -EREMOTEIO;
+		goto out;
+	}
+	ret = usb_read(adapter, CMD_I2C_XFER_BATCH, 0, 0, buf, len);
+
+	if (ret < 1) {
+		dev_err(&adapter->dev, "failure reading smbus result\n");
+		ret = -EREMOTEIO;
+		goto out;
+	}
+
+	dev_dbg(&adapter->dev, "  status = %d\n", buf[0]);
+	if (buf[0] != STATUS_ADDRESS_ACK) {
+		ret = usb_status_error(buf[0], 1);
+		goto out;
+	}
+
+	/* a block read returns fewer bytes than requested */
+	if ((smflags & SMBUS_BLOCK) &&
+	    ((buf[1] < 1) || (buf[1] > I2C_SMBUS_BLOCK_MAX) ||
+	     (ret < buf[1] + 2))) {
+		dev_err(&adapter->dev, "invalid block length %d\n", buf[1]);
+		ret = -EPROTO;
+		goto out;
+	}
+
+	if (!(smflags & SMBUS_BLOCK) && (ret != len)) {
+		ret = -EREMOTEIO;
+		goto out;
+	}
+
+	ret = 0;
+	if (!(smflags & SMBUS_READ))
+		goto out;
+
+	switch (size) {
+	case I2C_SMBUS_BYTE:
+	case I2C_SMBUS_BYTE_DATA:
+		data->byte = buf[1];
+		break;
+	case I2C_SMBUS_WORD_DATA:
+	case I2C_SMBUS_PROC_CALL:
+		data->word = buf[1] | (buf[2] << 8);
+		break;
+	case I2C_SMBUS_BLOCK_DATA:
+	case I2C_SMBUS_BLOCK_PROC_CALL:
+		memcpy(data->block, buf + 1, buf[1] + 1);
+		break;
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+		memcpy(data->block + 1, buf + 1, rlen);
+		break;
+	}
+
+ out:
+	kfree(buf);
+	return ret;
+}
+
+static int usb_smbus_xfer(struct i2c_adapter *adapter, u16 addr,
+			  unsigned short flags, char read_write, u8 command,
+			  int size, union i2c_smbus_data *data)
+{
+	int ret;
+
+	/* the i2c core emulates everything the firmware can't do */
+	if (!(usb_features(adapter) & FEATURE_SMBUS))
+		return -EOPNOTSUPP;
+
+	/* see usb_xfer() for probes and eeprom write cycles */
+	if ((size == I2C_SMBUS_QUICK) && (read_write == I2C_SMBUS_READ)) {
+		ret = usb_scan_probe(adapter, addr);
+		if (ret >= 0)
+			return ret ? 0 : -ENXIO;
+	}
+
+	ret = usb_smbus_run(adapter, addr, flags, read_write, command,
+			    size, data);
+
+	if ((ret == -ENXIO) && usb_wait_ack(adapter, addr))
+		ret = usb_smbus_run(adapter, addr, flags, read_write, command,
+				    size, data);
+
+	usb_write_done(adapter, (!ret && (read_write == I2C_SMBUS_WRITE) &&
+				 (size != I2C_SMBUS_PROC_CALL) &&
+				 (size != I2C_SMBUS_BLOCK_PROC_CALL)) ?
+		       addr : -1);
+
+	if ((ret == -ETIMEDOUT) && adapter->bus_recovery_info)
+		i2c_recover_bus(adapter);
+
+	return ret;
 }
 
 /* This is the actual algorithm we define */
 static const struct i2c_algorithm usb_algorithm = {
 	.master_xfer	= usb_xfer,
+	.smbus_xfer	= usb_smbus_xfer,
 	.functionality	= usb_func,
 };
 
@@ -145,6 +656,38 @@ struct i2c_tiny_usb {
 	struct usb_device *usb_dev; /* the usb device for this device */
 	struct usb_interface *interface; /* the interface for this device */
 	struct i2c_adapter adapter; /* i2c related things */
+	u32 func; /* functionality reported by the firmware */
+	u32 features; /* protocol extensions supported by the firmware */
+	int batch_size; /* result buffer of a batch transfer */
+	int max_read, max_write; /* longest message part per request */
+	int min_delay, max_delay; /* supported bit delay range */
+	struct i2c_adapter_quirks quirks; /* limits if not split */
+	struct i2c_bus_recovery_info recovery; /* CMD_I2C_RECOVER */
+
+	/* preallocated requests for queued transfers */
+	struct urb *urbs[ASYNC_URBS];
+	struct usb_ctrlrequest *setup;
+	struct usb_anchor anchor;
+	struct completion done;
+	atomic_t pending;
+
+	/* interrupt endpoints of the stream protocol */
+	struct usb_endpoint_descriptor *int_in, *int_out;
+
+	int last_write; /* slave written by the last transfer or -1 */
+
+	/* result of the last bus scan */
+	unsigned char scan[16];
+	unsigned long scan_time;
+	int scan_valid; /* cleared once the map may be outdated */
+
+	/* register polling via sysfs, interval and timeout as set on the */
+	/* device and the reply of the last poll */
+	int poll_interval, poll_timeout;
+	unsigned char poll[4];
+
+	/* bit delay of the clients with their own clock, 0 if none */
+	u16 speed[128];
 };
 
 static int usb_read(struct i2c_adapter *adapter, int cmd,
@@ -169,8 +712,699 @@ static int usb_write(struct i2c_adapter *adapter, int cmd,
 			       value, index, data, len, 2000);
 }
 
+/* functionality is read from the device once in probe */
+static u32 usb_func(struct i2c_adapter *adapter)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+
+	return dev->func;
+}
+
+static u32 usb_features(struct i2c_adapter *adapter)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+
+	return dev->features;
+}
+
+static int usb_batch_size(struct i2c_adapter *adapter)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+
+	return dev->batch_size;
+}
+
+static int usb_max_write(struct i2c_adapter *adapter)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+
+	return dev->max_write;
+}
+
+/* read the capability descriptor, firmware without it reports its */
+/* functionality and features by separate requests */
+static int usb_get_caps(struct i2c_tiny_usb *dev)
+{
+	struct i2c_tiny_usb_caps *caps;
+	int len;
+
+	dev->batch_size = BATCH_SIZE;
+	dev->max_read = MAX_READ;
+	dev->max_write = MAX_WRITE;
+	dev->min_delay = 1;
+	dev->max_delay = 0xffff;
+
+	caps = kzalloc(sizeof(*caps), GFP_KERNEL);
+	if (caps == NULL)
+		return -ENOMEM;
+
+	len = usb_read(&dev->adapter, CMD_GET_CAPS, 0, 0, caps, sizeof(*caps));
+	if ((len >= (int)sizeof(*caps)) && (caps->version >= 1)) {
+		dev->func = le32_to_cpu(caps->func);
+		dev->features = le32_to_cpu(caps->features);
+		dev->batch_size = le16_to_cpu(caps->batch_size);
+		dev->max_read = le16_to_cpu(caps->max_read);
+		dev->max_write = le16_to_cpu(caps->max_write);
+		dev->min_delay = le16_to_cpu(caps->min_delay);
+		dev->max_delay = le16_to_cpu(caps->max_delay);
+
+		dev_dbg(&dev->interface->dev, "capabilities version %d, "
+			"max read %d, max write %d, batch %d, fifo %d\n",
+			caps->version, dev->max_read,
+			dev->max_write, dev->batch_size,
+			le16_to_cpu(caps->write_fifo));
+		goto out;
+	}
+
+	if (usb_read(&dev->adapter, CMD_GET_FUNC, 0, 0, &caps->func,
+		     sizeof(caps->func)) != sizeof(caps->func)) {
+		dev_err(&dev->interface->dev,
+			"failure reading functionality\n");
+		kfree(caps);
+		return -EIO;
+	}
+	dev->func = le32_to_cpu(caps->func);
+
+	/* firmware without protocol extensions returns nothing here */
+	if (usb_read(&dev->adapter, CMD_GET_FEATURES, 0, 0, &caps->features,
+		     sizeof(caps->features)) == sizeof(caps->features))
+		dev->features = le32_to_cpu(caps->features);
+
+ out:
+	kfree(caps);
+	return 0;
+}
+
+/* status of the last message, firmware reporting data NAKs also tells */
+/* the number of bytes written before, -1 if unknown */
+static int usb_get_status(struct i2c_adapter *adapter, int *acked)
+{
+	unsigned char *buf;
+	int ret;
+
+	buf = kmalloc(3, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	ret = usb_read(adapter, CMD_GET_STATUS, 0, 0, buf, 3);
+	*acked = (ret == 3) ? (buf[1] | (buf[2] << 8)) : -1;
+	if (ret > 0)
+		ret = buf[0];
+	else if (ret == 0)
+		ret = -EREMOTEIO;
+
+	kfree(buf);
+	return ret;
+}
+
+/* line states in the reply of CMD_I2C_RECOVER */
+#define RECOVER_SDA		(1<<0)
+#define RECOVER_SCL		(1<<1)
+
+/* let the device clock a client holding SDA low out of its transfer */
+/* and end it with a stop condition, called via i2c_recover_bus() */
+static int usb_recover_bus(struct i2c_adapter *adapter)
+{
+	unsigned char *buf;
+	int ret;
+
+	buf = kmalloc(3, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	if ((usb_write(adapter, CMD_I2C_RECOVER, 0, 0, NULL, 0) != 0) ||
+	    (usb_read(adapter, CMD_I2C_XFER_BATCH, 0, 0, buf, 3) != 3)) {
+		dev_err(&adapter->dev, "failure recovering the bus\n");
+		ret = -EIO;
+		goto out;
+	}
+
+	dev_dbg(&adapter->dev, "recovery: SDA %d SCL %d -> SDA %d SCL %d, "
+		"%d clocks\n", !!(buf[0] & RECOVER_SDA),
+		!!(buf[0] & RECOVER_SCL), !!(buf[1] & RECOVER_SDA),
+		!!(buf[1] & RECOVER_SCL), buf[2]);
+
+	/* the scan cache may be wrong about a client that was stuck */
+	((struct i2c_tiny_usb *)adapter->algo_data)->scan_valid = 0;
+
+	ret = ((buf[1] & (RECOVER_SDA | RECOVER_SCL)) ==
+	       (RECOVER_SDA | RECOVER_SCL)) ? 0 : -EBUSY;
+	if (ret)
+		dev_warn(&adapter->dev, "bus still %s low after recovery\n",
+			 (buf[1] & RECOVER_SCL) ? "SDA" : "SCL");
+ out:
+	kfree(buf);
+	return ret;
+}
+
+static void usb_write_done(struct i2c_adapter *adapter, int addr)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+
+	dev->last_write = addr;
+
+	/* a write may e.g. have switched a mux, scan again */
+	if (addr >= 0)
+		dev->scan_valid = 0;
+}
+
+/* answer a zero length read probe from a recent scan, returns 1 if the */
+/* address was acknowledged, 0 if not and -1 if it has to be probed */
+static int usb_scan_probe(struct i2c_adapter *adapter, int addr)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+	unsigned char *buf;
+
+	/* an eeprom in its write cycle has to be waited for */
+	if (!(dev->features & FEATURE_SCAN) || (scan_cache <= 0) ||
+	    (addr < SCAN_FIRST) || (addr > SCAN_LAST) ||
+	    (addr == dev->last_write))
+		return -1;
+
+	if (!dev->scan_valid ||
+	    time_after(jiffies, dev->scan_time +
+		       msecs_to_jiffies(scan_cache))) {
+		dev->scan_valid = 0;
+
+		/* the map must not share cache lines with the device struct */
+		buf = kmalloc(sizeof(dev->scan), GFP_KERNEL);
+		if (buf == NULL)
+			return -1;
+
+		if ((usb_write(adapter, CMD_I2C_SCAN, 0xffff,
+			       SCAN_FIRST | (SCAN_LAST << 8), NULL, 0) != 0) ||
+		    (usb_read(adapter, CMD_I2C_XFER_BATCH, 0, 0, buf,
+			      sizeof(dev->scan)) != sizeof(dev->scan))) {
+			dev_err(&adapter->dev, "failure scanning bus\n");
+			kfree(buf);
+			return -1;
+		}
+
+		memcpy(dev->scan, buf, sizeof(dev->scan));
+		kfree(buf);
+
+		dev->scan_valid = 1;
+		dev->scan_time = jiffies;
+	}
+
+	dev_dbg(&adapter->dev, "  0x%02x %s from scan\n", addr,
+		(dev->scan[addr / 8] & (1 << (addr % 8))) ? "ack" : "nak");
+
+	return (dev->scan[addr / 8] >> (addr % 8)) & 1;
+}
+
+/* poll a slave on the device after it has been written to, returns */
+/* true once it acknowledges its address */
+static int usb_wait_ack(struct i2c_adapter *adapter, int addr)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+	unsigned char *reply;
+	int ret = 0;
+
+	if (!(dev->features & FEATURE_WAIT_ACK) || (wait_ack <= 0) ||
+	    (dev->last_write != addr))
+		return 0;
+
+	reply = kmalloc(3, GFP_KERNEL);
+	if (reply == NULL)
+		return 0;
+
+	if ((usb_write(adapter, CMD_I2C_WAIT_ACK, addr, wait_ack,
+		       NULL, 0) != 0) ||
+	    (usb_read(adapter, CMD_I2C_XFER_BATCH, 0, 0, reply, 3) != 3)) {
+		dev_err(&adapter->dev, "failure waiting for ack\n");
+		goto out;
+	}
+
+	dev_dbg(&adapter->dev, "  0x%02x %s after %dms\n", addr,
+		reply[0] == STATUS_ADDRESS_ACK ? "ready" : "not ready",
+		reply[1] | (reply[2] << 8));
+
+	ret = (reply[0] == STATUS_ADDRESS_ACK);
+ out:
+	kfree(reply);
+	return ret;
+}
+
+/* let the device read a register until (value & mask) == match */
+static int usb_poll_reg(struct i2c_adapter *adapter, int addr, int reg,
+			int mask, int match, int interval, int timeout)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+	unsigned char *buf;
+	int ret;
+
+	/* the timing is kept by the device between polls */
+	if ((interval != dev->poll_interval) ||
+	    (timeout != dev->poll_timeout)) {
+		if (usb_write(adapter, CMD_SET_POLL,
+			      interval, timeout, NULL, 0) != 0)
+			return -EIO;
+
+		dev->poll_interval = interval;
+		dev->poll_timeout = timeout;
+	}
+
+	/* the reply must not share cache lines with the device struct */
+	buf = kmalloc(sizeof(dev->poll), GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	ret = usb_write(adapter, CMD_I2C_POLL_REG, addr | (reg << 8),
+			mask | (match << 8), NULL, 0);
+	if (ret == 0)
+		ret = usb_read(adapter, CMD_I2C_XFER_BATCH, 0, 0, buf,
+			       sizeof(dev->poll));
+	if (ret == sizeof(dev->poll))
+		memcpy(dev->poll, buf, sizeof(dev->poll));
+	kfree(buf);
+
+	if (ret != sizeof(dev->poll)) {
+		dev_err(&adapter->dev, "failure polling register\n");
+		return -EIO;
+	}
+
+	dev_dbg(&adapter->dev, "  0x%02x reg 0x%02x = 0x%02x after %d reads\n",
+		addr, reg, dev->poll[1], dev->poll[2] | (dev->poll[3] << 8));
+
+	if (dev->poll[0] != STATUS_ADDRESS_ACK)
+		return -ENXIO;
+
+	return ((dev->poll[1] & mask) == match) ? 0 : -ETIMEDOUT;
+}
+
+/* "addr reg mask value [interval timeout]" starts a register poll on the */
+/* device, reading back returns the last value read and the read count */
+static ssize_t poll_reg_show(struct device *d, struct device_attribute *attr,
+			     char *buf)
+{
+	struct i2c_tiny_usb *dev = usb_get_intfdata(to_usb_interface(d));
+	int len;
+
+	/* the reply is updated by poll_reg_store() under the bus lock */
+	i2c_lock_bus(&dev->adapter, I2C_LOCK_SEGMENT);
+	len = sysfs_emit(buf, "0x%02x %d\n", dev->poll[1],
+			 dev->poll[2] | (dev->poll[3] << 8));
+	i2c_unlock_bus(&dev->adapter, I2C_LOCK_SEGMENT);
+
+	return len;
+}
+
+static ssize_t poll_reg_store(struct device *d, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct i2c_tiny_usb *dev = usb_get_intfdata(to_usb_interface(d));
+	int addr, reg, mask, match, interval = 1, timeout = 100;
+	int ret;
+
+	if (!(dev->features & FEATURE_POLL_REG))
+		return -EOPNOTSUPP;
+
+	if ((sscanf(buf, "%i %i %i %i %i %i", &addr, &reg, &mask, &match,
+		    &interval, &timeout) < 4) ||
+	    (addr & ~0x7f) || (reg & ~0xff) || (mask & ~0xff) ||
+	    (match & ~0xff) || (interval < 0) || (interval > 1000) ||
+	    (timeout < 0) || (timeout > 1000))
+		return -EINVAL;
+
+	i2c_lock_bus(&dev->adapter, I2C_LOCK_SEGMENT);
+	ret = usb_poll_reg(&dev->adapter, addr, reg, mask, match,
+			   interval, timeout);
+	i2c_unlock_bus(&dev->adapter, I2C_LOCK_SEGMENT);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_RW(poll_reg);
+
+/* "addr delay" sets the bit delay in us the device uses for a client */
+/* instead of the one of the bus, a delay of 0 removes it again */
+static ssize_t slave_delay_show(struct device *d,
+				struct device_attribute *attr, char *buf)
+{
+	struct i2c_tiny_usb *dev = usb_get_intfdata(to_usb_interface(d));
+	int i, len = 0;
+
+	for (i = 0 ; i < ARRAY_SIZE(dev->speed) ; i++)
+		if (dev->speed[i])
+			len += sysfs_emit_at(buf, len, "0x%02x %d\n",
+					     i, dev->speed[i]);
+
+	return len;
+}
+
+static ssize_t slave_delay_store(struct device *d,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct i2c_tiny_usb *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned char *reply;
+	int addr, slave_delay, ret;
+
+	if (!(dev->features & FEATURE_SPEED))
+		return -EOPNOTSUPP;
+
+	if ((sscanf(buf, "%i %i", &addr, &slave_delay) != 2) ||
+	    (addr & ~0x7f) ||
+	    (slave_delay && ((slave_delay < dev->min_delay) ||
+			     (slave_delay > dev->max_delay))))
+		return -EINVAL;
+
+	reply = kmalloc(1, GFP_KERNEL);
+	if (reply == NULL)
+		return -ENOMEM;
+
+	i2c_lock_bus(&dev->adapter, I2C_LOCK_SEGMENT);
+	ret = usb_read(&dev->adapter, CMD_SET_SPEED, slave_delay, addr,
+		       reply, 1);
+	i2c_unlock_bus(&dev->adapter, I2C_LOCK_SEGMENT);
+
+	if (ret != 1) {
+		ret = -EIO;
+	} else if (!reply[0]) {
+		ret = -ENOSPC;	/* the table of the device is full */
+	} else {
+		dev->speed[addr] = slave_delay;
+		ret = count;
+	}
+
+	kfree(reply);
+	return ret;
+}
+
+static DEVICE_ATTR_RW(slave_delay);
+
+static struct attribute *i2c_tiny_usb_attrs[] = {
+	&dev_attr_poll_reg.attr,
+	&dev_attr_slave_delay.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(i2c_tiny_usb);
+
+static void usb_async_complete(struct urb *urb)
+{
+	struct i2c_tiny_usb *dev = urb->context;
+
+	/* wake up the caller once all queued requests are done */
+	if (atomic_dec_and_test(&dev->pending))
+		complete(&dev->done);
+}
+
+static void usb_async_fill(struct i2c_tiny_usb *dev, int n, int cmd,
+			   int dir, int value, int index, void *data, int len)
+{
+	struct usb_ctrlrequest *setup = &dev->setup[n];
+
+	setup->bRequestType = USB_TYPE_VENDOR | USB_RECIP_INTERFACE | dir;
+	setup->bRequest = cmd;
+	setup->wValue = cpu_to_le16(value);
+	setup->wIndex = cpu_to_le16(index);
+	setup->wLength = cpu_to_le16(len);
+
+	usb_fill_control_urb(dev->urbs[n], dev->usb_dev,
+			     dir ? usb_rcvctrlpipe(dev->usb_dev, 0) :
+			     usb_sndctrlpipe(dev->usb_dev, 0),
+			     (unsigned char *)setup, data, len,
+			     usb_async_complete, dev);
+}
+
+/* submit the first n prepared requests back to back and wait for all */
+static int usb_async_run(struct i2c_tiny_usb *dev, int n)
+{
+	int i, ret = 0;
+
+	reinit_completion(&dev->done);
+	atomic_set(&dev->pending, n);
+
+	for (i = 0 ; i < n ; i++) {
+		usb_anchor_urb(dev->urbs[i], &dev->anchor);
+		ret = usb_submit_urb(dev->urbs[i], GFP_KERNEL);
+		if (ret) {
+			usb_unanchor_urb(dev->urbs[i]);
+			dev_err(&dev->interface->dev,
+				"failure submitting request: %d\n", ret);
+
+			/* account for the requests never submitted */
+			if (atomic_sub_and_test(n - i, &dev->pending))
+				complete(&dev->done);
+			break;
+		}
+	}
+
+	if (!wait_for_completion_timeout(&dev->done,
+					 msecs_to_jiffies(2000))) {
+		usb_kill_anchored_urbs(&dev->anchor);
+		dev_err(&dev->interface->dev, "device not responding\n");
+		/* -ETIMEDOUT means a client stretched the clock too long */
+		ret = -EIO;
+	}
+
+	return ret;
+}
+
+/* a message, or the part of it a single request carries */
+struct usb_async_seg {
+	int msg;		/* index of the message */
+	int offset, len;	/* part of the message data */
+};
+
+/* queue up to ASYNC_URBS-1 message parts of a transaction starting */
+/* with message *msg at *offset and advance both, a trailing write is */
+/* followed by a status request */
+static int usb_async_round(struct i2c_tiny_usb *dev, struct i2c_msg *msgs,
+			   int *msg, int *offset, int num)
+{
+	struct usb_async_seg seg[ASYNC_URBS - 1];
+	unsigned char *buf, *p;
+	int i, n, count, len = 3, status = STATUS_ADDRESS_ACK, acked = -1, ret;
+
+	/* parts longer than a request can carry continue in the next one */
+	for (count = 0 ; (count < ASYNC_URBS - 1) && (*msg < num) ; count++) {
+		struct i2c_msg *pmsg = &msgs[*msg];
+
+		seg[count].msg = *msg;
+		seg[count].offset = *offset;
+		seg[count].len = min_t(int, pmsg->len - *offset,
+				       (pmsg->flags & I2C_M_RD) ?
+				       dev->max_read : dev->max_write);
+		len += ASYNC_BUF(seg[count].len + 1);
+
+		*offset += seg[count].len;
+		if (*offset >= pmsg->len) {
+			(*msg)++;
+			*offset = 0;
+		}
+	}
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	for (n = 0, p = buf ; n < count ; n++) {
+		struct i2c_msg *pmsg = &msgs[seg[n].msg];
+		int cmd = CMD_I2C_IO | CMD_I2C_IO_STATUS;
+		int flags = pmsg->flags;
+		int last = (seg[n].offset + seg[n].len == pmsg->len);
+
+		if (seg[n].offset)
+			flags |= I2C_M_NOSTART;
+		else if (seg[n].msg == 0)
+			cmd |= CMD_I2C_IO_BEGIN;
+
+		if (!last)
+			flags |= I2C_TINY_USB_M_MORE;
+		else if (seg[n].msg == num-1)
+			cmd |= CMD_I2C_IO_END;
+
+		dev_dbg(&dev->adapter.dev,
+			"  %d: %s (flags %d) %d bytes at %d to 0x%02x\n",
+			seg[n].msg, pmsg->flags & I2C_M_RD ? "read" : "write",
+			pmsg->flags, seg[n].len, seg[n].offset, pmsg->addr);
+
+		/* read data comes with the status appended */
+		if (pmsg->flags & I2C_M_RD) {
+			usb_async_fill(dev, n, cmd, USB_DIR_IN, flags,
+				       pmsg->addr, p, seg[n].len + 1);
+		} else {
+			memcpy(p, pmsg->buf + seg[n].offset, seg[n].len);
+			usb_async_fill(dev, n, cmd, USB_DIR_OUT, flags,
+				       pmsg->addr, p, seg[n].len);
+		}
+
+		p += ASYNC_BUF(seg[n].len + 1);
+	}
+
+	if (!(msgs[num-1].flags & I2C_M_RD) && (*msg == num))
+		usb_async_fill(dev, n++, CMD_GET_STATUS, USB_DIR_IN,
+			       0, 0, p, 3);
+
+	ret = usb_async_run(dev, n);
+	if (ret)
+		goto out;
+
+	for (n = 0, p = buf ; n < count ; n++) {
+		struct i2c_msg *pmsg = &msgs[seg[n].msg];
+		struct urb *urb = dev->urbs[n];
+
+		/* a failed message ends a read early with the status */
+		/* following the data sent so far and stalls a write, */
+		/* its status is fetched then */
+		if ((pmsg->flags & I2C_M_RD) && !urb->status &&
+		    (urb->actual_length > 0) &&
+		    (urb->actual_length < urb->transfer_buffer_length) &&
+		    usb_status_failed(p[urb->actual_length - 1])) {
+			status = p[urb->actual_length - 1];
+			dev_dbg(&dev->adapter.dev, "  status = %d\n", status);
+			break;
+		}
+
+		if (!(pmsg->flags & I2C_M_RD) && (urb->status == -EPIPE)) {
+			status = usb_get_status(&dev->adapter, &acked);
+			dev_dbg(&dev->adapter.dev, "  status = %d\n", status);
+			if (status < 0) {
+				dev_err(&dev->adapter.dev,
+					"failure reading status\n");
+				ret = -EREMOTEIO;
+				goto out;
+			}
+			break;
+		}
+
+		if (urb->status || urb->actual_length !=
+		    urb->transfer_buffer_length) {
+			dev_err(&dev->adapter.dev, "failure %s data\n",
+				pmsg->flags & I2C_M_RD ?
+				"reading" : "writing");
+			ret = -EREMOTEIO;
+			goto out;
+		}
+
+		if (pmsg->flags & I2C_M_RD) {
+			memcpy(pmsg->buf + seg[n].offset, p, seg[n].len);
+			status = p[seg[n].len];
+
+			dev_dbg(&dev->adapter.dev, "  status = %d\n", status);
+			if (usb_status_failed(status))
+				break;
+		}
+
+		p += ASYNC_BUF(seg[n].len + 1);
+	}
+
+	i = (n < count) ? seg[n].msg : *msg;
+	if ((i == num) && !(msgs[num-1].flags & I2C_M_RD)) {
+		if (dev->urbs[n]->status || !dev->urbs[n]->actual_length) {
+			dev_err(&dev->adapter.dev, "failure reading status\n");
+			ret = -EREMOTEIO;
+			goto out;
+		}
+
+		status = p[0];
+		if (dev->urbs[n]->actual_length == 3)
+			acked = p[1] | (p[2] << 8);
+		dev_dbg(&dev->adapter.dev, "  status = %d\n", status);
+	}
+
+	/* firmware which doesn't stall writes only has the sticky status, */
+	/* which doesn't tell which write failed */
+	if (status == STATUS_DATA_NAK)
+		dev_dbg(&dev->adapter.dev, "  byte %d not acked\n", acked);
+
+	if (usb_status_failed(status)) {
+		ret = usb_status_error(status, (i == 0) || (num == 1));
+	} else if (n < count) {
+		/* a write stalled without a failure status */
+		ret = -EREMOTEIO;
+	}
+
+ out:
+	kfree(buf);
+	return ret;
+}
+
+/* Messages the device can't take in a single request are split into */
+/* parts continued without start and address. All parts of a round are */
+/* queued at once, so the next request is waiting while the device */
+/* still transfers the current one. */
+static int usb_xfer_async(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			  int num)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+	int msg = 0, offset = 0, ret;
+
+	while (msg < num) {
+		ret = usb_async_round(dev, msgs, &msg, &offset, num);
+		if (ret)
+			return ret;
+	}
+
+	return num;
+}
+
+/* A stream frame is a batch sent to the interrupt OUT endpoint, prefixed */
+/* with the number of segments. The device answers on the interrupt IN */
+/* endpoint with the length of the batch result followed by the result. */
+static int usb_xfer_stream(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			   int num)
+{
+	struct i2c_tiny_usb *dev = (struct i2c_tiny_usb *)adapter->algo_data;
+	unsigned char *buf, *reply;
+	int len, rlen, ret;
+
+	len = 1 + usb_batch_len(msgs, num);
+
+	buf = kmalloc(ASYNC_BUF(len) + 1 + dev->batch_size, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	reply = buf + ASYNC_BUF(len);
+
+	buf[0] = num;
+	rlen = usb_batch_pack(msgs, num, buf + 1);
+
+	/* the reply is polled for before the frame is sent */
+	usb_fill_int_urb(dev->urbs[0], dev->usb_dev,
+			 usb_rcvintpipe(dev->usb_dev,
+					usb_endpoint_num(dev->int_in)),
+			 reply, 1 + rlen, usb_async_complete, dev,
+			 dev->int_in->bInterval);
+
+	usb_fill_int_urb(dev->urbs[1], dev->usb_dev,
+			 usb_sndintpipe(dev->usb_dev,
+					usb_endpoint_num(dev->int_out)),
+			 buf, len, usb_async_complete, dev,
+			 dev->int_out->bInterval);
+
+	ret = usb_async_run(dev, 2);
+	if (!ret && (dev->urbs[0]->status || dev->urbs[1]->status ||
+		     dev->urbs[0]->actual_length != 1 + rlen ||
+		     reply[0] != rlen))
+		ret = -EREMOTEIO;
+
+	if (ret) {
+		/* device and driver may be out of sync now */
+		dev_err(&adapter->dev, "stream failure %d, using control "
+			"transfers from now on\n", ret);
+		dev->features &= ~FEATURE_INT_EP;
+		ret = -EREMOTEIO;
+		goto out;
+	}
+
+	ret = usb_batch_result(adapter, msgs, num, reply + 1);
+
+ out:
+	kfree(buf);
+	return ret;
+}
+
 static void i2c_tiny_usb_free(struct i2c_tiny_usb *dev)
 {
+	int i;
+
+	for (i = 0 ; i < ASYNC_URBS ; i++)
+		usb_free_urb(dev->urbs[i]);
+
+	kfree(dev->setup);
 	usb_put_dev(dev->usb_dev);
 	kfree(dev);
 }
@@ -181,6 +1415,7 @@ static int i2c_tiny_usb_probe(struct usb_interface *interface,
 	struct i2c_tiny_usb *dev;
 	int retval = -ENOMEM;
 	u16 version;
+	int i, bit_delay;
 
 	dev_dbg(&interface->dev, "probing usb device\n");
 
@@ -194,6 +1429,26 @@ static int i2c_tiny_usb_probe(struct usb_interface *interface,
 	dev->usb_dev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
 
+	init_usb_anchor(&dev->anchor);
+	init_completion(&dev->done);
+	dev->last_write = -1;
+	dev->scan_valid = 0;
+	dev->poll_interval = dev->poll_timeout = -1;
+
+	dev->setup = kmalloc(ASYNC_URBS * sizeof(*dev->setup), GFP_KERNEL);
+	if (dev->setup == NULL) {
+		dev_err(&interface->dev, "Out of memory\n");
+		goto error;
+	}
+
+	for (i = 0 ; i < ASYNC_URBS ; i++) {
+		dev->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (dev->urbs[i] == NULL) {
+			dev_err(&interface->dev, "Out of memory\n");
+			goto error;
+		}
+	}
+
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
 
@@ -212,14 +1467,56 @@ static int i2c_tiny_usb_probe(struct usb_interface *interface,
 		 "i2c-tiny-usb at bus %03d device %03d",
 		 dev->usb_dev->bus->busnum, dev->usb_dev->devnum);
 
+	/* functionality, features and limits are only read once */
+	retval = usb_get_caps(dev);
+	if (retval)
+		goto error;
+
+	/* longer messages are split if the firmware can continue them, */
+	/* the parts are queued using inline status */
+	if (!(dev->features & FEATURE_CHUNK) ||
+	    !(dev->features & FEATURE_INLINE_STATUS)) {
+		dev->quirks.max_read_len = dev->max_read;
+		dev->quirks.max_write_len = dev->max_write;
+		dev->adapter.quirks = &dev->quirks;
+	}
+
+	/* the i2c core frees a stuck bus using the device */
+	if (dev->features & FEATURE_RECOVER) {
+		dev->recovery.recover_bus = usb_recover_bus;
+		dev->adapter.bus_recovery_info = &dev->recovery;
+	}
+
+	bit_delay = clamp_t(int, delay, dev->min_delay, dev->max_delay);
+	if (bit_delay != delay)
+		dev_warn(&interface->dev, "delay %dus out of range %d-%dus, "
+			 "using %dus\n", delay, dev->min_delay,
+			 dev->max_delay, bit_delay);
+
 	if (usb_write(&dev->adapter, CMD_SET_DELAY,
-		      cpu_to_le16(delay), 0, NULL, 0) != 0) {
+		      cpu_to_le16(bit_delay), 0, NULL, 0) != 0) {
 		dev_err(&dev->adapter.dev, 
-			"failure setting delay to %dus\n", delay);
+			"failure setting delay to %dus\n", bit_delay);
 		retval = -EIO;
 		goto error;
 	}
 
+	if ((dev->features & FEATURE_STRETCH) &&
+	    (usb_write(&dev->adapter, CMD_SET_STRETCH,
+		       cpu_to_le16(stretch_timeout), 0, NULL, 0) != 0))
+		dev_warn(&interface->dev, "failure setting the clock stretch "
+			 "timeout to %dms\n", stretch_timeout);
+
+	/* the stream protocol needs both interrupt endpoints */
+	if ((dev->features & FEATURE_INT_EP) &&
+	    usb_find_common_endpoints(interface->cur_altsetting, NULL, NULL,
+				      &dev->int_in, &dev->int_out)) {
+		dev_warn(&interface->dev, "interrupt endpoints missing\n");
+		dev->features &= ~FEATURE_INT_EP;
+	}
+
+	dev_dbg(&dev->interface->dev, "firmware features %x\n", dev->features);
+
 	dev->adapter.dev.parent = &dev->interface->dev;
 
 	/* and finally attach to i2c layer */
@@ -242,6 +1539,7 @@ static void i2c_tiny_usb_disconnect(struct usb_interface *interface)
 	struct i2c_tiny_usb *dev = usb_get_intfdata(interface);
 
 	i2c_del_adapter(&dev->adapter);
+	usb_kill_anchored_urbs(&dev->anchor);
 	usb_set_intfdata(interface, NULL);
 	i2c_tiny_usb_free(dev);
 
@@ -253,10 +1551,21 @@ static struct usb_driver i2c_tiny_usb_driver = {
 	.probe =	i2c_tiny_usb_probe,
 	.disconnect =	i2c_tiny_usb_disconnect,
 	.id_table =	i2c_tiny_usb_table,
+	.dev_groups =	i2c_tiny_usb_groups,
 };
 
 static int __init usb_i2c_tiny_usb_init(void)
 {
+	int timeout = clamp_t(int, stretch_timeout, STRETCH_MIN, STRETCH_MAX);
+
+	/* the firmware limits the wait, CMD_SET_STRETCH only has 16 bits */
+	if (timeout != stretch_timeout) {
+		pr_warn("i2c-tiny-usb: stretch_timeout %dms out of range "
+			"%d-%dms, using %dms\n", stretch_timeout,
+			STRETCH_MIN, STRETCH_MAX, timeout);
+		stretch_timeout = timeout;
+	}
+
 	/* register this driver with the USB subsystem */
 	return usb_register(&i2c_tiny_usb_driver);
 }
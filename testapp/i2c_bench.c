@@ -0,0 +1,510 @@
+/*
+ * i2c_bench.c - throughput and latency benchmark for the i2c-tiny-usb
+ *               interface, http://www.harbaum.org/till/i2c_tiny_usb
+ *
+ * Runs a sweep over payload sizes, read/write mix, i2c clock delays
+ * and messages per transaction and reports transactions/s, bytes/s
+ * and latency percentiles as CSV or JSON. With -s the built-in
+ * software device stand-in (i2c_sim.c) is used instead of real
+ * hardware, so the benchmark also runs without an adapter attached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#ifndef SIM_ONLY
+#include <usb.h>
+#else
+#define USB_TYPE_CLASS    (0x01 << 5)
+#define USB_ENDPOINT_IN   0x80
+#endif
+
+#include "i2c_tiny_usb.h"
+#include "i2c_sim.h"
+
+#define USB_CTRL_IN    (USB_TYPE_CLASS | USB_ENDPOINT_IN)
+#define USB_CTRL_OUT   (USB_TYPE_CLASS)
+
+/* the vendor and product id was donated by ftdi ... many thanks!*/
+#define I2C_TINY_USB_VID  0x0403
+#define I2C_TINY_USB_PID  0xc631
+
+#define MAX_LIST  16
+#define MAX_MSGS  16
+#define MAX_SIZE  255
+
+/* how a transaction is put on the wire */
+#define MODE_AUTO    0
+#define MODE_LEGACY  1    // I2C_IO + GET_STATUS per message
+#define MODE_INLINE  2    // status returned with read data
+#define MODE_BATCH   3    // whole transaction in one batch request
+
+static const char *mode_names[] = { "auto", "legacy", "inline", "batch" };
+
+struct msg {
+  int rd;
+  int len;
+  unsigned char buf[MAX_SIZE+1];
+};
+
+#ifndef SIM_ONLY
+usb_dev_handle      *handle = NULL;
+#endif
+static int simulate = 0;
+static unsigned long features = 0;
+
+/* ------------------------------------------------------------------------- */
+
+static int control_msg(int requesttype, int request, int value, int index,
+		       char *bytes, int size) {
+#ifndef SIM_ONLY
+  if(!simulate)
+    return usb_control_msg(handle, requesttype, request, value, index,
+			   bytes, size, 1000);
+#endif
+  return i2c_sim_control_msg(requesttype, request, value, index,
+			     bytes, size);
+}
+
+static const char *control_error(void) {
+#ifndef SIM_ONLY
+  if(!simulate)
+    return usb_strerror();
+#endif
+  return "simulated transfer failed";
+}
+
+/* current time in microseconds, simulated time when running on the sim */
+static double now_us(void) {
+  struct timeval tv;
+
+  if(simulate)
+    return i2c_sim_time();
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/* write a set of bytes to the i2c_tiny_usb device */
+int i2c_tiny_usb_write(int request, int value, int index) {
+  if(control_msg(USB_CTRL_OUT, request, value, index, NULL, 0) < 0) {
+    fprintf(stderr, "USB error: %s\n", control_error());
+    return -1;
+  }
+  return 1;
+}
+
+/* read a set of bytes from the i2c_tiny_usb device */
+int i2c_tiny_usb_read(unsigned char cmd, void *data, int len) {
+  int                 nBytes;
+
+  /* send control request and accept return value */
+  nBytes = control_msg(USB_CTRL_IN, cmd, 0, 0, data, len);
+
+  if(nBytes < 0) {
+    fprintf(stderr, "USB error: %s\n", control_error());
+    return nBytes;
+  }
+
+  return nBytes;
+}
+
+/* get the current transaction status from the i2c_tiny_usb interface */
+int i2c_tiny_usb_get_status(void) {
+  unsigned char status;
+
+  if(i2c_tiny_usb_read(CMD_GET_STATUS, &status, sizeof(status)) != 1)
+    return -1;
+
+  return status;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* one message at a time, each followed by a status request */
+static int xfer_legacy(int addr, struct msg *msgs, int num) {
+  int i, cmd;
+
+  for(i=0;i<num;i++) {
+    cmd = CMD_I2C_IO;
+    if(i == 0)     cmd |= CMD_I2C_BEGIN;
+    if(i == num-1) cmd |= CMD_I2C_END;
+
+    if(control_msg(msgs[i].rd?USB_CTRL_IN:USB_CTRL_OUT, cmd,
+		   msgs[i].rd?I2C_M_RD:0, addr,
+		   (char*)msgs[i].buf, msgs[i].len) != msgs[i].len)
+      return -1;
+
+    if(i2c_tiny_usb_get_status() != STATUS_ADDRESS_ACK)
+      return -1;
+  }
+  return 0;
+}
+
+/* status comes with the read data, only trailing writes need a request */
+static int xfer_inline(int addr, struct msg *msgs, int num) {
+  int i, cmd, status = STATUS_ADDRESS_ACK;
+
+  for(i=0;i<num;i++) {
+    cmd = CMD_I2C_IO | CMD_I2C_STATUS;
+    if(i == 0)     cmd |= CMD_I2C_BEGIN;
+    if(i == num-1) cmd |= CMD_I2C_END;
+
+    if(msgs[i].rd) {
+      if(control_msg(USB_CTRL_IN, cmd, I2C_M_RD, addr,
+		     (char*)msgs[i].buf, msgs[i].len+1) != msgs[i].len+1)
+	return -1;
+      status = msgs[i].buf[msgs[i].len];
+    } else {
+      if(control_msg(USB_CTRL_OUT, cmd, 0, addr,
+		     (char*)msgs[i].buf, msgs[i].len) != msgs[i].len)
+	return -1;
+      if(i == num-1)
+	status = i2c_tiny_usb_get_status();
+    }
+
+    if(status != STATUS_ADDRESS_ACK)
+      return -1;
+  }
+  return 0;
+}
+
+/* the whole transaction in one OUT and one IN transfer */
+static int xfer_batch(int addr, struct msg *msgs, int num) {
+  unsigned char buf[MAX_MSGS * (MAX_SIZE + 3)], *p;
+  int i, len, rlen = num;
+
+  for(p=buf, i=0;i<num;i++) {
+    *p++ = msgs[i].rd?I2C_M_RD:0;
+    *p++ = addr;
+    *p++ = msgs[i].len;
+    if(msgs[i].rd)
+      rlen += msgs[i].len;
+    else {
+      memcpy(p, msgs[i].buf, msgs[i].len);
+      p += msgs[i].len;
+    }
+  }
+
+  len = p - buf;
+  if(control_msg(USB_CTRL_OUT, CMD_I2C_XFER_BATCH, num, 0,
+		 (char*)buf, len) != len)
+    return -1;
+
+  if(control_msg(USB_CTRL_IN, CMD_I2C_XFER_BATCH, num, 0,
+		 (char*)buf, rlen) != rlen)
+    return -1;
+
+  for(p=buf+num, i=0;i<num;i++) {
+    if(buf[i] != STATUS_ADDRESS_ACK)
+      return -1;
+    if(msgs[i].rd) {
+      memcpy(msgs[i].buf, p, msgs[i].len);
+      p += msgs[i].len;
+    }
+  }
+  return 0;
+}
+
+/* pick the cheapest method the device supports, like the kernel driver */
+static int xfer_mode(int mode, struct msg *msgs, int num) {
+  int i, rlen = num;
+
+  for(i=0;i<num;i++)
+    if(msgs[i].rd) rlen += msgs[i].len;
+
+  if(mode == MODE_AUTO) {
+    if((num > 1) && (features & FEATURE_XFER_BATCH) && (rlen <= BATCH_SIZE))
+      return MODE_BATCH;
+    if(features & FEATURE_INLINE_STATUS)
+      return MODE_INLINE;
+    return MODE_LEGACY;
+  }
+
+  /* fall back if the batch buffer is too small */
+  if((mode == MODE_BATCH) && (rlen > BATCH_SIZE))
+    return (features & FEATURE_INLINE_STATUS)?MODE_INLINE:MODE_LEGACY;
+
+  return mode;
+}
+
+static int xfer(int mode, int addr, struct msg *msgs, int num) {
+  switch(xfer_mode(mode, msgs, num)) {
+  case MODE_BATCH:  return xfer_batch(addr, msgs, num);
+  case MODE_INLINE: return xfer_inline(addr, msgs, num);
+  }
+  return xfer_legacy(addr, msgs, num);
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct result {
+  int delay, msgs, size, read_pct;
+  const char *mode;
+  int count, errors;
+  double tps, bps;
+  double p50, p99, p999;
+};
+
+static int cmp_double(const void *a, const void *b) {
+  double da = *(const double*)a, db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+/* value below which the given fraction of the sorted samples fall */
+static double percentile(double *sorted, int n, double p) {
+  int i = (int)(p * n + 0.999999) - 1;
+
+  if(i < 0) i = 0;
+  if(i >= n) i = n-1;
+  return sorted[i];
+}
+
+static void run(struct result *r, int mode, int addr, int count) {
+  struct msg msgs[MAX_MSGS];
+  double *lat, start, t0, t;
+  long bytes = 0, k = 0;
+  int i, j, used = -1;
+
+  lat = malloc(count * sizeof(double));
+  if(!lat) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  i2c_tiny_usb_write(CMD_SET_DELAY, r->delay, 0);
+
+  r->errors = 0;
+  start = now_us();
+  for(i=0;i<count;i++) {
+    /* spread the reads evenly over all messages */
+    for(j=0;j<r->msgs;j++, k++) {
+      msgs[j].rd = ((k+1) * r->read_pct / 100) != (k * r->read_pct / 100);
+      msgs[j].len = r->size;
+      if(!msgs[j].rd) {
+	/* first byte sets the register/memory address */
+	memset(msgs[j].buf, k, msgs[j].len);
+	msgs[j].buf[0] = 0;
+      }
+    }
+
+    /* the method may change with the read mix of a transaction */
+    j = xfer_mode(mode, msgs, r->msgs);
+    used = (used < 0 || used == j)?j:MODE_AUTO;
+
+    t0 = now_us();
+    if(xfer(mode, addr, msgs, r->msgs) < 0)
+      r->errors++;
+    else
+      bytes += r->msgs * r->size;
+    lat[i] = now_us() - t0;
+  }
+  t = now_us() - start;
+
+  qsort(lat, count, sizeof(double), cmp_double);
+
+  r->count = count;
+  r->mode = (used == MODE_AUTO)?"mixed":mode_names[used];
+  r->tps = t?1000000.0 * (count - r->errors) / t:0;
+  r->bps = t?1000000.0 * bytes / t:0;
+  r->p50 = percentile(lat, count, 0.5);
+  r->p99 = percentile(lat, count, 0.99);
+  r->p999 = percentile(lat, count, 0.999);
+
+  free(lat);
+}
+
+static void print_result(struct result *r, int json, int first) {
+  if(json) {
+    printf("%s  { \"delay\": %d, \"msgs\": %d, \"size\": %d, "
+	   "\"read_pct\": %d, \"mode\": \"%s\", \"transactions\": %d, "
+	   "\"errors\": %d, \"tps\": %.1f, \"bps\": %.1f, "
+	   "\"p50_us\": %.0f, \"p99_us\": %.0f, \"p999_us\": %.0f }",
+	   first?"":",\n", r->delay, r->msgs, r->size, r->read_pct, r->mode,
+	   r->count, r->errors, r->tps, r->bps, r->p50, r->p99, r->p999);
+  } else {
+    if(first)
+      printf("delay,msgs,size,read_pct,mode,transactions,errors,"
+	     "tps,bps,p50_us,p99_us,p999_us\n");
+    printf("%d,%d,%d,%d,%s,%d,%d,%.1f,%.1f,%.0f,%.0f,%.0f\n",
+	   r->delay, r->msgs, r->size, r->read_pct, r->mode, r->count,
+	   r->errors, r->tps, r->bps, r->p50, r->p99, r->p999);
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* parse a comma separated list of numbers */
+static int parse_list(const char *str, int *list, int min, int max) {
+  int n = 0;
+  char *end;
+
+  while(*str && n < MAX_LIST) {
+    list[n] = strtol(str, &end, 0);
+    if((end == str) || (list[n] < min) || (list[n] > max)) {
+      fprintf(stderr, "Invalid list value \"%s\" (%d..%d)\n", str, min, max);
+      exit(1);
+    }
+    n++;
+    str = (*end == ',')?end+1:end;
+  }
+  return n;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -s         use the simulated device instead of hardware\n"
+	  "  -a addr    i2c client address (default 0x50)\n"
+	  "  -n count   transactions per measurement (default 200)\n"
+	  "  -l list    payload sizes in bytes (default 1,4,16,64)\n"
+	  "  -r list    percentage of read messages (default 0,50,100)\n"
+	  "  -d list    CMD_SET_DELAY values in us (default 10)\n"
+	  "  -m list    messages per transaction (default 1,2)\n"
+	  "  -p mode    auto, legacy, inline or batch (default auto)\n"
+	  "  -j         JSON instead of CSV output\n"
+	  "  -S model   add a simulated client, model[@addr] (default ram@0x50)\n"
+	  "  -T timing  timing model of the simulation (default lowspeed)\n"
+	  "\nSimulated clients:\n", name);
+  i2c_sim_list_models(stderr);
+  fprintf(stderr, "\nTiming models:\n");
+  i2c_sim_list_timings(stderr);
+  exit(1);
+}
+
+#ifndef SIM_ONLY
+static usb_dev_handle *open_device(void) {
+  struct usb_bus      *bus;
+  struct usb_device   *dev;
+
+  usb_init();
+
+  usb_find_busses();
+  usb_find_devices();
+
+  for(bus = usb_get_busses(); bus; bus = bus->next) {
+    for(dev = bus->devices; dev; dev = dev->next) {
+      if((dev->descriptor.idVendor == I2C_TINY_USB_VID) &&
+	 (dev->descriptor.idProduct == I2C_TINY_USB_PID)) {
+	usb_dev_handle *h = usb_open(dev);
+
+	if(!h)
+	  fprintf(stderr, "Error: Cannot open the device: %s\n",
+		  usb_strerror());
+	return h;
+      }
+    }
+  }
+  return NULL;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  int sizes[MAX_LIST] = { 1, 4, 16, 64 }, nsizes = 4;
+  int mixes[MAX_LIST] = { 0, 50, 100 }, nmixes = 3;
+  int delays[MAX_LIST] = { 10 }, ndelays = 1;
+  int msgs[MAX_LIST] = { 1, 2 }, nmsgs = 2;
+  int addr = 0x50, count = 200, mode = MODE_AUTO, json = 0;
+  int d, m, l, r, c, first = 1, clients = 0;
+  struct result res;
+
+  i2c_sim_init();
+
+  while((c = getopt(argc, argv, "sa:n:l:r:d:m:p:jS:T:")) != -1) {
+    switch(c) {
+    case 's': simulate = 1; break;
+    case 'S':
+      if(!i2c_sim_add(optarg)) exit(1);
+      clients++;
+      break;
+    case 'T':
+      if(i2c_sim_set_timing(optarg) < 0) exit(1);
+      break;
+    case 'a': addr = strtol(optarg, NULL, 0); break;
+    case 'n': count = atoi(optarg); break;
+    case 'l': nsizes = parse_list(optarg, sizes, 1, MAX_SIZE); break;
+    case 'r': nmixes = parse_list(optarg, mixes, 0, 100); break;
+    case 'd': ndelays = parse_list(optarg, delays, 1, 0xffff); break;
+    case 'm': nmsgs = parse_list(optarg, msgs, 1, MAX_MSGS); break;
+    case 'j': json = 1; break;
+    case 'p':
+      for(mode=0;mode<4;mode++)
+	if(!strcmp(optarg, mode_names[mode])) break;
+      if(mode == 4) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if(count < 1)
+    usage(argv[0]);
+
+#ifdef SIM_ONLY
+  simulate = 1;
+#endif
+
+  /* plain memory by default, a real eeprom would be busy after writes */
+  if(simulate) {
+    if(!clients)
+      i2c_sim_add("ram@0x50");
+  }
+#ifndef SIM_ONLY
+  else {
+    if(!(handle = open_device())) {
+      fprintf(stderr, "Error: Could not find i2c_tiny_usb device\n");
+      exit(1);
+    }
+
+    if(usb_claim_interface(handle, 0) != 0) {
+      fprintf(stderr, "USB error: %s\n", usb_strerror());
+      exit(1);
+    }
+  }
+#endif
+
+  /* firmware without protocol extensions returns nothing */
+  {
+    unsigned char buf[4];
+
+    if(i2c_tiny_usb_read(CMD_GET_FEATURES, buf, sizeof(buf)) == sizeof(buf))
+      features = buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+	((unsigned long)buf[3] << 24);
+  }
+
+  if(mode == MODE_INLINE && !(features & FEATURE_INLINE_STATUS))
+    fprintf(stderr, "Warning: device lacks inline status support\n");
+  if(mode == MODE_BATCH && !(features & FEATURE_XFER_BATCH))
+    fprintf(stderr, "Warning: device lacks batch transfer support\n");
+
+  if(json) printf("[\n");
+
+  for(d=0;d<ndelays;d++)
+    for(m=0;m<nmsgs;m++)
+      for(l=0;l<nsizes;l++)
+	for(r=0;r<nmixes;r++) {
+	  res.delay = delays[d];
+	  res.msgs = msgs[m];
+	  res.size = sizes[l];
+	  res.read_pct = mixes[r];
+
+	  run(&res, mode, addr, count);
+	  print_result(&res, json, first);
+	  fflush(stdout);
+	  first = 0;
+	}
+
+  if(json) printf("\n]\n");
+
+#ifndef SIM_ONLY
+  if(handle) {
+    usb_release_interface(handle, 0);
+    usb_close(handle);
+  }
+#endif
+
+  return 0;
+}
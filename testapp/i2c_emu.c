@@ -0,0 +1,320 @@
+/*
+ * i2c_emu.c - virtual i2c-tiny-usb device for linux
+ *             http://www.harbaum.org/till/i2c_tiny_usb
+ *
+ * Presents the simulated device of i2c_sim.c to the local usb host
+ * using the raw-gadget interface. Together with the dummy_hcd module
+ * this results in a device the i2c-tiny-usb kernel driver and the
+ * test application can be used with like with real hardware:
+ *
+ *   modprobe dummy_hcd
+ *   modprobe raw_gadget
+ *   ./i2c_emu -S 24c02 -S ds1621 -S pcf8574
+ *
+ * By default replies are delayed according to the selected timing
+ * model, so throughput measurements roughly match a real device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "i2c_tiny_usb.h"
+#include "i2c_sim.h"
+
+#define RAW_GADGET "/dev/raw-gadget"
+
+/* the vendor and product id was donated by ftdi ... many thanks!*/
+#define I2C_TINY_USB_VID  0x0403
+#define I2C_TINY_USB_PID  0xc631
+
+#define EP0_MAX  4096
+
+static int verbose = 0;
+
+static struct usb_device_descriptor dev_desc = {
+  .bLength            = USB_DT_DEVICE_SIZE,
+  .bDescriptorType    = USB_DT_DEVICE,
+  .bcdUSB             = 0x0110,
+  .bDeviceClass       = USB_CLASS_VENDOR_SPEC,
+  .bMaxPacketSize0    = 8,
+  .idVendor           = I2C_TINY_USB_VID,
+  .idProduct          = I2C_TINY_USB_PID,
+  .bcdDevice          = 0x0105,
+  .iManufacturer      = 1,
+  .iProduct           = 2,
+  .bNumConfigurations = 1,
+};
+
+/* one interface without any endpoints besides ep0 */
+static struct {
+  struct usb_config_descriptor config;
+  struct usb_interface_descriptor iface;
+} __attribute__ ((packed)) conf_desc = {
+  .config = {
+    .bLength             = USB_DT_CONFIG_SIZE,
+    .bDescriptorType     = USB_DT_CONFIG,
+    .wTotalLength        = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE,
+    .bNumInterfaces      = 1,
+    .bConfigurationValue = 1,
+    .bmAttributes        = USB_CONFIG_ATT_ONE,
+    .bMaxPower           = 10/2,
+  },
+  .iface = {
+    .bLength             = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType     = USB_DT_INTERFACE,
+  },
+};
+
+static const char *strings[] = { NULL, "Till Harbaum", "i2c-tiny-usb" };
+
+struct control_event {
+  struct usb_raw_event event;
+  struct usb_ctrlrequest ctrl;
+};
+
+struct ep0_io {
+  struct usb_raw_ep_io io;
+  unsigned char data[EP0_MAX];
+};
+
+/* ------------------------------------------------------------------------- */
+
+static unsigned long now_us(void) {
+  static struct timeval start;
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  if(!start.tv_sec)
+    start = tv;
+
+  return (tv.tv_sec - start.tv_sec) * 1000000ul + tv.tv_usec - start.tv_usec;
+}
+
+static void ioctl_check(int fd, unsigned long req, void *arg,
+			const char *name) {
+  if(ioctl(fd, req, arg) < 0) {
+    fprintf(stderr, "Error: %s failed: %s\n", name, strerror(errno));
+    exit(1);
+  }
+}
+
+static int string_desc(int index, unsigned char *buf) {
+  const char *s;
+  int i;
+
+  if(index == 0) {
+    /* english (us) is the only language */
+    buf[0] = 4; buf[1] = USB_DT_STRING; buf[2] = 0x09; buf[3] = 0x04;
+    return 4;
+  }
+
+  if(index >= (int)(sizeof(strings)/sizeof(strings[0])))
+    return -1;
+
+  s = strings[index];
+  for(i=0;s[i];i++) {
+    buf[2+2*i] = s[i];
+    buf[3+2*i] = 0;
+  }
+  buf[0] = 2+2*i;
+  buf[1] = USB_DT_STRING;
+  return buf[0];
+}
+
+/* handle chapter 9 requests, returns the reply length or -1 to stall */
+static int standard_request(int fd, struct usb_ctrlrequest *ctrl,
+			    unsigned char *buf) {
+  int type = ctrl->wValue >> 8;
+
+  switch(ctrl->bRequest) {
+  case USB_REQ_GET_DESCRIPTOR:
+    if(type == USB_DT_DEVICE) {
+      memcpy(buf, &dev_desc, sizeof(dev_desc));
+      return sizeof(dev_desc);
+    }
+    if(type == USB_DT_CONFIG) {
+      memcpy(buf, &conf_desc, sizeof(conf_desc));
+      return sizeof(conf_desc);
+    }
+    if(type == USB_DT_STRING)
+      return string_desc(ctrl->wValue & 0xff, buf);
+    return -1;
+
+  case USB_REQ_SET_CONFIGURATION:
+    ioctl_check(fd, USB_RAW_IOCTL_VBUS_DRAW,
+		(void*)(unsigned long)conf_desc.config.bMaxPower,
+		"USB_RAW_IOCTL_VBUS_DRAW");
+    ioctl_check(fd, USB_RAW_IOCTL_CONFIGURE, NULL, "USB_RAW_IOCTL_CONFIGURE");
+    return 0;
+
+  case USB_REQ_GET_CONFIGURATION:
+    buf[0] = 1;
+    return 1;
+
+  case USB_REQ_SET_INTERFACE:
+    return 0;
+
+  case USB_REQ_GET_INTERFACE:
+    buf[0] = 0;
+    return 1;
+
+  case USB_REQ_GET_STATUS:
+    buf[0] = buf[1] = 0;
+    return 2;
+  }
+
+  return -1;
+}
+
+static void control(int fd, struct usb_ctrlrequest *ctrl, int pace) {
+  struct ep0_io ep0;
+  unsigned long start = 0;
+  int len, in = ctrl->bRequestType & USB_DIR_IN;
+
+  memset(&ep0, 0, sizeof(ep0));
+  len = ctrl->wLength;
+  if(len > EP0_MAX) len = EP0_MAX;
+
+  if((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD) {
+    len = standard_request(fd, ctrl, ep0.data);
+    if(len > ctrl->wLength) len = ctrl->wLength;
+  } else {
+    /* the device is idle while nobody talks to it */
+    i2c_sim_sync(now_us());
+    start = i2c_sim_time();
+
+    /* fetch the data stage first for OUT transfers */
+    if(!in && len) {
+      ep0.io.length = len;
+      len = ioctl(fd, USB_RAW_IOCTL_EP0_READ, &ep0);
+      if(len < 0) {
+	fprintf(stderr, "Error: USB_RAW_IOCTL_EP0_READ failed: %s\n",
+		strerror(errno));
+	return;
+      }
+    }
+
+    len = i2c_sim_control_msg(ctrl->bRequestType, ctrl->bRequest,
+			      ctrl->wValue, ctrl->wIndex,
+			      (char*)ep0.data, len);
+
+    if(verbose)
+      printf("%s req %2d val 0x%04x idx 0x%04x len %3d -> %d\n",
+	     in?"IN ":"OUT", ctrl->bRequest, ctrl->wValue, ctrl->wIndex,
+	     ctrl->wLength, len);
+
+    /* delay the reply like the real device would */
+    if(pace) {
+      long wait = (long)(i2c_sim_time() - start) -
+	(long)(now_us() - start);
+      if(wait > 0)
+	usleep(wait);
+    }
+
+    if(!in) {
+      /* the data stage has already been acknowledged */
+      if(ctrl->wLength) return;
+      len = 0;
+    }
+  }
+
+  if(len < 0) {
+    if(verbose)
+      printf("stall request %d\n", ctrl->bRequest);
+    ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+    return;
+  }
+
+  ep0.io.length = len;
+  if(in)
+    ioctl_check(fd, USB_RAW_IOCTL_EP0_WRITE, &ep0, "USB_RAW_IOCTL_EP0_WRITE");
+  else
+    ioctl_check(fd, USB_RAW_IOCTL_EP0_READ, &ep0, "USB_RAW_IOCTL_EP0_READ");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -S model   add a simulated client, model[@addr]\n"
+	  "             (default 24c02, ds1621 and pcf8574)\n"
+	  "  -T timing  timing model (default lowspeed)\n"
+	  "  -f         reply as fast as possible, ignore the timing model\n"
+	  "  -d driver  udc driver name (default dummy_udc)\n"
+	  "  -n device  udc device name (default dummy_udc.0)\n"
+	  "  -v         log all vendor requests\n"
+	  "\nSimulated clients:\n", name);
+  i2c_sim_list_models(stderr);
+  fprintf(stderr, "\nTiming models:\n");
+  i2c_sim_list_timings(stderr);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *driver = "dummy_udc", *device = "dummy_udc.0";
+  struct usb_raw_init init;
+  struct control_event ev;
+  int fd, c, clients = 0, pace = 1;
+
+  i2c_sim_init();
+
+  while((c = getopt(argc, argv, "S:T:fd:n:v")) != -1) {
+    switch(c) {
+    case 'S':
+      if(!i2c_sim_add(optarg)) exit(1);
+      clients++;
+      break;
+    case 'T':
+      if(i2c_sim_set_timing(optarg) < 0) exit(1);
+      break;
+    case 'f': pace = 0; break;
+    case 'd': driver = optarg; break;
+    case 'n': device = optarg; break;
+    case 'v': verbose = 1; break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if(!clients) {
+    i2c_sim_add("24c02");
+    i2c_sim_add("ds1621");
+    i2c_sim_add("pcf8574");
+  }
+
+  fd = open(RAW_GADGET, O_RDWR);
+  if(fd < 0) {
+    fprintf(stderr, "Error: Cannot open %s: %s\n", RAW_GADGET,
+	    strerror(errno));
+    exit(1);
+  }
+
+  memset(&init, 0, sizeof(init));
+  strncpy((char*)init.driver_name, driver, UDC_NAME_LENGTH_MAX-1);
+  strncpy((char*)init.device_name, device, UDC_NAME_LENGTH_MAX-1);
+  init.speed = USB_SPEED_FULL;
+  ioctl_check(fd, USB_RAW_IOCTL_INIT, &init, "USB_RAW_IOCTL_INIT");
+  ioctl_check(fd, USB_RAW_IOCTL_RUN, NULL, "USB_RAW_IOCTL_RUN");
+
+  for(;;) {
+    memset(&ev, 0, sizeof(ev));
+    ev.event.length = sizeof(ev.ctrl);
+    ioctl_check(fd, USB_RAW_IOCTL_EVENT_FETCH, &ev,
+		"USB_RAW_IOCTL_EVENT_FETCH");
+
+    if(ev.event.type == USB_RAW_EVENT_CONNECT) {
+      if(verbose) printf("connected\n");
+    } else if(ev.event.type == USB_RAW_EVENT_CONTROL)
+      control(fd, &ev.ctrl, pace);
+  }
+
+  return 0;
+}
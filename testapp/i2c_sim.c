@@ -0,0 +1,827 @@
+/*
+ * i2c_sim.c - software stand-in for the i2c-tiny-usb device
+ *             http://www.harbaum.org/till/i2c_tiny_usb
+ *
+ * This implements the vendor requests of the firmware on the host
+ * side, so tools can be run without any hardware attached. Clients
+ * are added with i2c_sim_add(), models exist for 24cxx eeproms, the
+ * ds1621 thermometer and the pcf8574 port expander.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i2c_tiny_usb.h"
+#include "i2c_sim.h"
+
+/* I2C_FUNC_I2C | I2C_FUNC_NOSTART | I2C_FUNC_SMBUS_EMUL and the */
+/* CMD_I2C_SMBUS extras as reported by the firmware */
+#define SIM_FUNC       0x8fff8019
+#define SIM_FEATURES   (FEATURE_INLINE_STATUS | FEATURE_XFER_BATCH | \
+			FEATURE_WAIT_ACK | FEATURE_POLL_REG | FEATURE_SCAN | \
+			FEATURE_SMBUS | FEATURE_CHUNK | FEATURE_STRETCH | \
+			FEATURE_RECOVER | FEATURE_SPEED)
+
+/* size of the per client clock table */
+#define SIM_SPEED_SLOTS  8
+
+/* the real device needs about 2 frames per control transfer and the */
+/* bitbanged clock results in about 50kHz at a delay of 10us */
+static struct i2c_sim_timing timings[] = {
+  { "lowspeed", 2000, 1000, 2, 5000 },  // usb 1.1 low speed device
+  { "busonly",     0,    0, 2, 5000 },  // i2c bus only, usb for free
+  { "usbonly",  2000, 1000, 0,    0 },  // usb only, i2c for free
+  { "ideal",       0,    0, 0,    0 },  // count requests only
+  { NULL, 0, 0, 0, 0 }
+};
+
+struct i2c_sim_timing i2c_sim_timing;
+
+static unsigned long sim_time;
+static unsigned short delay;           // of the addressed client
+static unsigned short bus_delay;
+static unsigned short speed[128];      // per client delay, 0 uses bus_delay
+static unsigned char status;
+static unsigned short acked;           // bytes written before a data NAK
+static unsigned short poll_interval, poll_timeout;
+static struct i2c_sim_slave *slaves;   // list of all clients
+static struct i2c_sim_slave *active;   // currently addressed slave
+
+static unsigned char batch_buf[BATCH_SIZE];
+static int batch_used;
+
+/* ------------------------------------------------------------------------- */
+
+/* 24cxx eeprom, writes trigger a write cycle during which the */
+/* chip doesn't ACK its address */
+static int eeprom_start(struct i2c_sim_slave *slave, unsigned char addr,
+			int rd) {
+  if(sim_time < slave->busy_until)
+    return 0;
+
+  /* small chips take the upper address bits from the i2c address */
+  if(slave->alen == 1)
+    slave->ptr = ((addr - slave->addr) << 8) | (slave->ptr & 0xff);
+
+  slave->count = 0;
+  slave->dirty = 0;
+  return 1;
+}
+
+static int eeprom_write(struct i2c_sim_slave *slave, unsigned char b) {
+  unsigned int page = slave->page - 1;
+
+  if(slave->count < slave->alen) {
+    /* memory address, msb first */
+    if(slave->alen == 1)
+      slave->ptr = (slave->ptr & ~0xff) | b;
+    else if(!slave->count)
+      slave->ptr = (b << 8) | (slave->ptr & 0xff);
+    else
+      slave->ptr = (slave->ptr & ~0xff) | b;
+
+    slave->ptr &= slave->size - 1;
+  } else {
+    /* page write, address wraps within the page */
+    slave->mem[slave->ptr] = b;
+    slave->ptr = (slave->ptr & ~page) | ((slave->ptr + 1) & page);
+    slave->dirty = 1;
+  }
+
+  slave->count++;
+  return 1;
+}
+
+static unsigned char eeprom_read(struct i2c_sim_slave *slave, int last) {
+  unsigned char b = slave->mem[slave->ptr];
+
+  slave->ptr = (slave->ptr + 1) & (slave->size - 1);
+  return b;
+}
+
+static void eeprom_stop(struct i2c_sim_slave *slave) {
+  if(slave->dirty)
+    slave->busy_until = sim_time + i2c_sim_timing.write_us;
+  slave->dirty = 0;
+}
+
+/* plain memory, like an eeprom but without write cycle and page wrap */
+static void ram_stop(struct i2c_sim_slave *slave) {
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* ds1621 thermometer, registers kept in mem[] */
+#define DS1621_TEMP     0
+#define DS1621_TH       2
+#define DS1621_TL       4
+#define DS1621_CONFIG   6
+#define DS1621_COUNTER  7
+#define DS1621_SLOPE    8
+
+#define DS1621_DONE     0x80
+
+static int ds1621_reg(unsigned char cmd, int *len) {
+  *len = 2;
+  switch(cmd) {
+  case 0xaa: return DS1621_TEMP;
+  case 0xa1: return DS1621_TH;
+  case 0xa2: return DS1621_TL;
+  }
+
+  *len = 1;
+  switch(cmd) {
+  case 0xac: return DS1621_CONFIG;
+  case 0xa8: return DS1621_COUNTER;
+  case 0xa9: return DS1621_SLOPE;
+  }
+
+  *len = 0;
+  return 0;
+}
+
+static int ds1621_start(struct i2c_sim_slave *slave, unsigned char addr,
+			int rd) {
+  slave->count = 0;
+  return 1;
+}
+
+static int ds1621_write(struct i2c_sim_slave *slave, unsigned char b) {
+  int reg, len;
+
+  if(!slave->count++) {
+    slave->ptr = b;
+
+    /* conversions complete immediately */
+    if(b == 0xee)
+      slave->mem[DS1621_CONFIG] |= DS1621_DONE;
+
+    return 1;
+  }
+
+  reg = ds1621_reg(slave->ptr, &len);
+  if((slave->ptr == 0xac) && (slave->count == 2))
+    slave->mem[DS1621_CONFIG] = (slave->mem[DS1621_CONFIG] & ~3) | (b & 3);
+  else if(((slave->ptr == 0xa1) || (slave->ptr == 0xa2)) &&
+	  (slave->count <= 1 + len))
+    slave->mem[reg + slave->count - 2] = b;
+
+  return 1;
+}
+
+static unsigned char ds1621_read(struct i2c_sim_slave *slave, int last) {
+  int reg, len;
+
+  reg = ds1621_reg(slave->ptr, &len);
+  if(slave->count >= len)
+    return 0xff;
+
+  return slave->mem[reg + slave->count++];
+}
+
+static void ds1621_stop(struct i2c_sim_slave *slave) {
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* pcf8574 port expander, mem[0] is the output latch, mem[1] the */
+/* level applied to the pins from outside */
+static int pcf8574_start(struct i2c_sim_slave *slave, unsigned char addr,
+			 int rd) {
+  return 1;
+}
+
+static int pcf8574_write(struct i2c_sim_slave *slave, unsigned char b) {
+  slave->mem[0] = b;
+  return 1;
+}
+
+static unsigned char pcf8574_read(struct i2c_sim_slave *slave, int last) {
+  /* quasi bidirectional, pins driven low read back as low */
+  return slave->mem[0] & slave->mem[1];
+}
+
+static void pcf8574_stop(struct i2c_sim_slave *slave) {
+}
+
+/* ------------------------------------------------------------------------- */
+
+static struct model {
+  const char *name;
+  unsigned char addr;
+  unsigned int size, page;
+  unsigned char alen;
+  int (*start)(struct i2c_sim_slave *slave, unsigned char addr, int rd);
+  int (*write)(struct i2c_sim_slave *slave, unsigned char b);
+  unsigned char (*read)(struct i2c_sim_slave *slave, int last);
+  void (*stop)(struct i2c_sim_slave *slave);
+} models[] = {
+#define EEPROM eeprom_start, eeprom_write, eeprom_read, eeprom_stop
+  { "24c01",   0x50,   128,   8, 1, EEPROM },
+  { "24c02",   0x50,   256,   8, 1, EEPROM },
+  { "24c04",   0x50,   512,  16, 1, EEPROM },
+  { "24c08",   0x50,  1024,  16, 1, EEPROM },
+  { "24c16",   0x50,  2048,  16, 1, EEPROM },
+  { "24c32",   0x50,  4096,  32, 2, EEPROM },
+  { "24c64",   0x50,  8192,  32, 2, EEPROM },
+  { "24c128",  0x50, 16384,  64, 2, EEPROM },
+  { "24c256",  0x50, 32768,  64, 2, EEPROM },
+  { "24c512",  0x50, 65536, 128, 2, EEPROM },
+  { "ram",     0x50,   256, 256, 1,
+    eeprom_start, eeprom_write, eeprom_read, ram_stop },
+  { "ds1621",  0x48,    16,   0, 0,
+    ds1621_start, ds1621_write, ds1621_read, ds1621_stop },
+  { "pcf8574", 0x20,     2,   0, 0,
+    pcf8574_start, pcf8574_write, pcf8574_read, pcf8574_stop },
+  { NULL, 0, 0, 0, 0, NULL, NULL, NULL, NULL }
+};
+
+struct i2c_sim_slave *i2c_sim_add(const char *spec) {
+  struct i2c_sim_slave *slave, **p;
+  const char *at = strchr(spec, '@');
+  size_t len = at?(size_t)(at - spec):strlen(spec);
+  struct model *m;
+
+  for(m=models;m->name;m++)
+    if((strlen(m->name) == len) && !strncmp(m->name, spec, len))
+      break;
+
+  if(!m->name) {
+    fprintf(stderr, "Unknown i2c client model \"%s\"\n", spec);
+    return NULL;
+  }
+
+  slave = calloc(1, sizeof(*slave));
+  if(slave)
+    slave->mem = malloc(m->size);
+  if(!slave || !slave->mem) {
+    free(slave);
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+
+  slave->model = m->name;
+  slave->addr = at?strtol(at+1, NULL, 0):m->addr;
+  slave->naddr = (m->alen == 1 && m->size > 256)?m->size/256:1;
+  slave->start = m->start;
+  slave->write = m->write;
+  slave->read = m->read;
+  slave->stop = m->stop;
+  slave->size = m->size;
+  slave->page = m->page;
+  slave->alen = m->alen;
+
+  /* erased eeprom, idle port and power up register values */
+  memset(slave->mem, 0xff, m->size);
+  if(m->start == ds1621_start) {
+    static const unsigned char ds1621_regs[] =
+      { 0x19, 0x80, 0x1e, 0x00, 0x14, 0x00, DS1621_DONE, 0x0a, 0x10 };
+    memcpy(slave->mem, ds1621_regs, sizeof(ds1621_regs));   // 25.5 C
+  }
+
+  /* append to keep the order given by the user */
+  for(p=&slaves;*p;p=&(*p)->next);
+  *p = slave;
+
+  return slave;
+}
+
+void i2c_sim_list_models(FILE *f) {
+  struct model *m;
+
+  for(m=models;m->name;m++)
+    fprintf(f, "  %-8s at 0x%02x\n", m->name, m->addr);
+}
+
+int i2c_sim_set_timing(const char *name) {
+  struct i2c_sim_timing *t;
+
+  for(t=timings;t->name;t++) {
+    if(!strcmp(t->name, name)) {
+      i2c_sim_timing = *t;
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "Unknown timing model \"%s\"\n", name);
+  return -1;
+}
+
+void i2c_sim_list_timings(FILE *f) {
+  struct i2c_sim_timing *t;
+
+  for(t=timings;t->name;t++)
+    fprintf(f, "  %-8s %4luus/transfer %4luus/packet %lu*delay/bit\n",
+	    t->name, t->transfer_us, t->packet_us, t->bit_us);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void bus_clock(int bits) {
+  sim_time += bits * i2c_sim_timing.bit_us * delay;
+}
+
+static int bus_address(int start, unsigned char addr, int rd) {
+  delay = speed[addr & 0x7f]?speed[addr & 0x7f]:bus_delay;
+
+  bus_clock(start?1:2);      // a repeated start needs an extra clock
+  bus_clock(9);
+
+  for(active=slaves;active;active=active->next)
+    if((addr >= active->addr) && (addr < active->addr + active->naddr))
+      break;
+
+  if(active && !active->start(active, addr, rd))
+    active = NULL;
+
+  return active != NULL;
+}
+
+static int bus_write(unsigned char b) {
+  bus_clock(9);
+  return active && active->write(active, b);
+}
+
+static unsigned char bus_read(int last) {
+  bus_clock(9);
+  return active?active->read(active, last):0xff;
+}
+
+static void bus_stop(void) {
+  bus_clock(1);
+  if(active)
+    active->stop(active);
+  active = NULL;
+}
+
+/* a message that failed aborts the rest of the transaction */
+static int failed(void) {
+  return (status == STATUS_ADDRESS_NAK) || (status == STATUS_DATA_NAK) ||
+    (status == STATUS_TIMEOUT);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int sim_i2c_io(int cmd, int flags, int addr, unsigned char *data,
+		      int len) {
+  int i, rd = flags & I2C_M_RD;
+  int dlen = len, st = 0, recv;
+
+  /* the first message always begins with a start condition */
+  if(cmd & CMD_I2C_BEGIN)
+    flags &= ~I2C_M_NOSTART;
+
+  /* the last byte of an IN transfer carries the status */
+  if((cmd & CMD_I2C_STATUS) && rd && dlen) {
+    dlen--;
+    st = 1;
+  }
+
+  /* the first byte read gives the length of the rest */
+  recv = rd && (flags & I2C_M_RECV_LEN) && dlen;
+
+  /* a failed message aborts the rest of the transaction, a continued */
+  /* message goes on with its data */
+  if(!(flags & I2C_M_NOSTART) &&
+     !((cmd & CMD_I2C_STATUS) && !(cmd & CMD_I2C_BEGIN) &&
+       failed())) {
+    if(bus_address(cmd & CMD_I2C_BEGIN, addr, rd))
+      status = STATUS_ADDRESS_ACK;
+    else {
+      status = STATUS_ADDRESS_NAK;
+      bus_stop();
+    }
+  }
+
+  if(!(flags & I2C_M_NOSTART))
+    acked = 0;
+
+  /* an unacknowledged address ends a read early with just the status */
+  /* and stalls the data stage of a write, so does a failed message */
+  if(failed()) {
+    if(!rd && len)
+      return -1;
+    dlen = 0;
+  }
+
+  for(i=0;i<dlen;i++) {
+    if(status != STATUS_ADDRESS_ACK) {
+      if(rd) data[i] = 0;
+    } else if(rd) {
+      data[i] = bus_read((i == dlen-1) && !recv && !(flags & I2C_M_MORE));
+
+      if(recv) {
+	int n = data[i], extra = dlen - 1 - I2C_SMBUS_BLOCK_MAX;
+
+	recv = 0;
+	if(extra < 0) extra = 0;
+	if(!n || (n > I2C_SMBUS_BLOCK_MAX)) {
+	  bus_read(1);
+	  n = extra = 0;
+	}
+	dlen = 1 + n + extra;
+      }
+    } else if(bus_write(data[i]) || (flags & I2C_M_IGNORE_NAK))
+      acked++;
+    else {
+      /* the rest of the message is dropped */
+      status = STATUS_DATA_NAK;
+      bus_stop();
+    }
+  }
+
+  if((status == STATUS_ADDRESS_ACK) && (cmd & CMD_I2C_END))
+    bus_stop();
+
+  if(st)
+    data[dlen] = status;
+
+  return dlen + st;
+}
+
+static void sim_batch(int segs, unsigned char *data, int len) {
+  int seg, i, flags, addr, slen;
+  unsigned char *end = data + len;
+
+  if(segs > BATCH_SIZE)
+    segs = 0;
+
+  memset(batch_buf, STATUS_IDLE, segs);
+  batch_used = segs;
+  status = STATUS_ADDRESS_ACK;
+
+  for(seg=0;(seg<segs) && (end-data >= 3);seg++) {
+    flags = *data++;
+    addr = *data++;
+    slen = *data++;
+
+    if(status == STATUS_ADDRESS_ACK) {
+      if(bus_address(!seg, addr, flags & I2C_M_RD))
+	batch_buf[seg] = STATUS_ADDRESS_ACK;
+      else {
+	batch_buf[seg] = STATUS_ADDRESS_NAK;
+	status = STATUS_ADDRESS_NAK;
+	bus_stop();
+      }
+    }
+
+    for(i=0;i<slen;i++) {
+      if(flags & I2C_M_RD) {
+	unsigned char c = 0;
+	if(batch_buf[seg] == STATUS_ADDRESS_ACK)
+	  c = bus_read(i == slen-1);
+	if(batch_used < BATCH_SIZE)
+	  batch_buf[batch_used++] = c;
+      } else if(data < end) {
+	if((batch_buf[seg] == STATUS_ADDRESS_ACK) && !bus_write(*data)) {
+	  batch_buf[seg] = STATUS_DATA_NAK;
+	  status = STATUS_DATA_NAK;
+	  bus_stop();
+	}
+	data++;
+      }
+    }
+  }
+
+  if(status == STATUS_ADDRESS_ACK)
+    bus_stop();
+}
+
+/* address the slave until it ACKs, returns the time taken in ms */
+static int sim_wait_ack(int addr, int timeout) {
+  unsigned long start = sim_time;
+
+  if(timeout > 1000) timeout = 1000;
+
+  do {
+    unsigned long t = sim_time;
+
+    status = bus_address(1, addr, 0)?STATUS_ADDRESS_ACK:STATUS_ADDRESS_NAK;
+    bus_stop();
+
+    /* the timing models without bus costs still need to progress */
+    if(sim_time == t)
+      sim_time++;
+  } while((status != STATUS_ADDRESS_ACK) &&
+	  (sim_time - start < timeout * 1000ul));
+
+  return (sim_time - start) / 1000;
+}
+
+/* read a register until (value & mask) == match, returns the number of */
+/* reads, the value read last is stored in *value */
+static int sim_poll_reg(int addr, int reg, int mask, int match,
+			unsigned char *value) {
+  unsigned long start = sim_time, next = sim_time;
+  int count = 0;
+
+  *value = 0;
+
+  for(;;) {
+    if(sim_time >= next) {
+      next = sim_time + poll_interval * 1000ul;
+      count++;
+
+      status = STATUS_ADDRESS_NAK;
+      if(bus_address(1, addr, 0) && bus_write(reg) &&
+	 bus_address(0, addr, 1)) {
+	*value = bus_read(1);
+	status = STATUS_ADDRESS_ACK;
+      }
+      bus_stop();
+
+      if((status == STATUS_ADDRESS_ACK) && ((*value & mask) == match))
+	return count;
+    }
+
+    /* skip the idle time up to the next read */
+    if(next > sim_time)
+      sim_time = next;
+    else
+      sim_time++;
+
+    if(sim_time - start >= poll_timeout * 1000ul)
+      return count;
+  }
+}
+
+/* probe the addresses first to last, read probes for the blocks of 8 */
+/* addresses selected in rd, the acknowledged ones are set in the map */
+static void sim_scan(int first, int last, int rd, unsigned char *map) {
+  int i;
+
+  memset(map, 0, 16);
+
+  for(i=first;(i<=last) && (i<128);i++) {
+    int r = (rd >> (i >> 3)) & 1;
+
+    if(bus_address(1, i, r)) {
+      map[i >> 3] |= 1 << (i & 7);
+      if(r)
+	bus_read(1);
+    }
+    bus_stop();
+  }
+}
+
+static unsigned char crc8(unsigned char crc, unsigned char b) {
+  int i;
+
+  crc ^= b;
+  for(i=0;i<8;i++)
+    crc = (crc & 0x80)?(crc << 1) ^ 0x07:(crc << 1);
+  return crc;
+}
+
+/* run a SMBus transaction, the result is left in the batch buffer */
+static void sim_smbus(int value, int index, unsigned char *data, int len) {
+  int addr = value & 0xff, flags = value >> 8, rlen = index >> 8;
+  unsigned char pec = 0, c;
+  int i, n;
+
+  if(rlen > BATCH_SIZE-2) rlen = BATCH_SIZE-2;
+  status = STATUS_ADDRESS_ACK;
+  batch_used = 1;
+
+  if((flags & SMBUS_CMD) || !(flags & SMBUS_READ)) {
+    pec = crc8(pec, addr << 1);
+    if(!bus_address(1, addr, 0)) {
+      status = STATUS_ADDRESS_NAK;
+      goto done;
+    }
+
+    /* a refused data byte ends the transaction */
+    if(flags & SMBUS_CMD) {
+      pec = crc8(pec, index & 0xff);
+      if(!bus_write(index & 0xff)) goto data_nak;
+    }
+    if(flags & SMBUS_DATA) {
+      pec = crc8(pec, index >> 8);
+      if(!bus_write(index >> 8)) goto data_nak;
+    }
+    for(i=0;i<len;i++) {
+      pec = crc8(pec, data[i]);
+      if(!bus_write(data[i])) goto data_nak;
+    }
+  }
+
+  if(!(flags & SMBUS_READ)) {
+    if((flags & SMBUS_PEC) && !bus_write(pec))
+      goto data_nak;
+    goto done;
+  }
+
+  pec = crc8(pec, (addr << 1) | 1);
+  if(!bus_address(!(flags & SMBUS_CMD), addr, 1)) {
+    status = STATUS_ADDRESS_NAK;
+    goto done;
+  }
+
+  n = rlen;
+  if(flags & SMBUS_BLOCK) {
+    n = c = bus_read(0);
+    pec = crc8(pec, c);
+    batch_buf[batch_used++] = c;
+    if(!n || (n > rlen)) {
+      bus_read(1);
+      goto done;
+    }
+  }
+
+  /* a quick read NAKs a byte to end the read */
+  if(!n && !(flags & SMBUS_PEC))
+    bus_read(1);
+
+  for(i=0;i<n;i++) {
+    c = bus_read((i == n-1) && !(flags & SMBUS_PEC));
+    pec = crc8(pec, c);
+    batch_buf[batch_used++] = c;
+  }
+
+  if((flags & SMBUS_PEC) && (bus_read(1) != pec))
+    status = STATUS_PEC_ERROR;
+  goto done;
+
+ data_nak:
+  status = STATUS_DATA_NAK;
+ done:
+  bus_stop();
+  batch_buf[0] = status;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void i2c_sim_init(void) {
+  struct i2c_sim_slave *next;
+
+  sim_time = 0;
+  delay = bus_delay = 10;
+  memset(speed, 0, sizeof(speed));
+  poll_interval = 1;
+  poll_timeout = 100;
+  status = STATUS_IDLE;
+  active = NULL;
+  batch_used = 0;
+  i2c_sim_timing = timings[0];
+
+  for(;slaves;slaves=next) {
+    next = slaves->next;
+    free(slaves->mem);
+    free(slaves);
+  }
+}
+
+unsigned long i2c_sim_time(void) {
+  return sim_time;
+}
+
+void i2c_sim_sync(unsigned long now) {
+  if(now > sim_time)
+    sim_time = now;
+}
+
+/* handle a vendor request like the firmware's usbFunctionSetup() */
+int i2c_sim_control_msg(int requesttype, int request, int value, int index,
+			char *bytes, int size) {
+  unsigned char *data = (unsigned char*)bytes;
+  unsigned long word;
+
+  sim_time += i2c_sim_timing.transfer_us;
+  sim_time += i2c_sim_timing.packet_us * ((size + 7) / 8);
+
+  switch(request) {
+  case CMD_ECHO:
+    if(size > 2) size = 2;
+    if(size > 0) data[0] = value & 0xff;
+    if(size > 1) data[1] = value >> 8;
+    return size;
+
+  case CMD_GET_FUNC:
+  case CMD_GET_FEATURES:
+    word = (request == CMD_GET_FUNC)?SIM_FUNC:SIM_FEATURES;
+    if(size > 4) size = 4;
+    for(index=0;index<size;index++)
+      data[index] = word >> (8*index);
+    return size;
+
+  case CMD_GET_CAPS:
+    {
+      /* max read/write, batch size, write fifo, delay range */
+      static const unsigned short limits[6] =
+	{ 254, 255, BATCH_SIZE, 16, 1, 0xffff };
+      unsigned char caps[CAPS_SIZE];
+      int i;
+
+      caps[0] = CAPS_SIZE;
+      caps[1] = CAPS_VERSION;
+      for(i=0;i<4;i++) {
+	caps[2+i] = (unsigned long)SIM_FUNC >> (8*i);
+	caps[6+i] = (unsigned long)SIM_FEATURES >> (8*i);
+      }
+      for(i=0;i<6;i++) {
+	caps[10+2*i] = limits[i] & 0xff;
+	caps[11+2*i] = limits[i] >> 8;
+      }
+
+      if(size > CAPS_SIZE) size = CAPS_SIZE;
+      memcpy(data, caps, size);
+    }
+    return size;
+
+  case CMD_SET_DELAY:
+    delay = bus_delay = value?value:1;
+    return 0;
+
+  case CMD_SET_SPEED:
+    /* the firmware has room for SIM_SPEED_SLOTS clients */
+    if(size < 1) return -1;
+    data[0] = 1;
+    if(value && !speed[index & 0x7f]) {
+      int i, used = 0;
+
+      for(i=0;i<128;i++)
+	if(speed[i]) used++;
+      data[0] = (used < SIM_SPEED_SLOTS);
+    }
+    if(data[0])
+      speed[index & 0x7f] = value;
+    return 1;
+
+  case CMD_SET_STRETCH:
+    /* the simulated clients never stretch the clock */
+    return 0;
+
+  case CMD_I2C_RECOVER:
+    /* the simulated clients never hold the bus, it is just reset */
+    bus_stop();
+    status = STATUS_IDLE;
+    batch_buf[0] = batch_buf[1] = RECOVER_SDA | RECOVER_SCL;
+    batch_buf[2] = 0;
+    batch_used = 3;
+    return 0;
+
+  case CMD_GET_STATUS:
+    if(size < 1) return 0;
+    data[0] = status;
+    if(size < 3) return 1;
+    data[1] = acked & 0xff;
+    data[2] = acked >> 8;
+    return 3;
+
+  /* the commands run after their OUT request, their result is */
+  /* fetched through CMD_I2C_XFER_BATCH */
+  case CMD_I2C_WAIT_ACK:
+    word = sim_wait_ack(value, index);
+    batch_buf[0] = status;
+    batch_buf[1] = word & 0xff;
+    batch_buf[2] = word >> 8;
+    batch_used = 3;
+    return 0;
+
+  case CMD_SET_POLL:
+    poll_interval = (value > 1000)?1000:value;
+    poll_timeout = (index > 1000)?1000:index;
+    return 0;
+
+  case CMD_I2C_POLL_REG:
+    {
+      unsigned char c;
+
+      word = sim_poll_reg(value & 0xff, value >> 8, index & 0xff, index >> 8,
+			  &c);
+      batch_buf[0] = status;
+      batch_buf[1] = c;
+      batch_buf[2] = word & 0xff;
+      batch_buf[3] = word >> 8;
+      batch_used = 4;
+    }
+    return 0;
+
+  case CMD_I2C_SCAN:
+    sim_scan(index & 0xff, index >> 8, value, batch_buf);
+    batch_used = 16;
+    return 0;
+
+  case CMD_I2C_SMBUS:
+    sim_smbus(value, index, data, size);
+    return size;
+
+  case CMD_I2C_XFER_BATCH:
+    if(requesttype & 0x80) {
+      if(size > batch_used) size = batch_used;
+      memcpy(data, batch_buf, size);
+      return size;
+    }
+    sim_batch(value, data, size);
+    return size;
+
+  default:
+    if((request & ~(CMD_I2C_BEGIN | CMD_I2C_END | CMD_I2C_STATUS))
+       == CMD_I2C_IO)
+      return sim_i2c_io(request, value, index, data, size);
+    break;
+  }
+
+  return 0;
+}
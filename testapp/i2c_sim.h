@@ -0,0 +1,65 @@
+/*
+ * i2c_sim.h - software stand-in for the i2c-tiny-usb device
+ *             http://www.harbaum.org/till/i2c_tiny_usb
+ */
+
+#ifndef I2C_SIM_H
+#define I2C_SIM_H
+
+#include <stdio.h>
+
+/* a simulated i2c client chip */
+struct i2c_sim_slave {
+  const char *model;
+  unsigned char addr;
+  unsigned char naddr;          /* number of consecutive addresses used */
+
+  /* return non-zero to ACK the address/byte */
+  int (*start)(struct i2c_sim_slave *slave, unsigned char addr, int rd);
+  int (*write)(struct i2c_sim_slave *slave, unsigned char b);
+  unsigned char (*read)(struct i2c_sim_slave *slave, int last);
+  void (*stop)(struct i2c_sim_slave *slave);
+
+  struct i2c_sim_slave *next;
+
+  /* model state */
+  unsigned int ptr;             /* address pointer/register */
+  int count;                    /* bytes written since start */
+  int dirty;                    /* data written since start */
+  unsigned long busy_until;     /* eeprom write cycle end */
+  unsigned int size;            /* memory size */
+  unsigned int page;            /* eeprom page size */
+  unsigned char alen;           /* bytes of memory address */
+  unsigned char *mem;
+};
+
+/* rough cost model of the usb control transfers and the bitbanged */
+/* i2c bus, all values in microseconds */
+struct i2c_sim_timing {
+  const char *name;
+  unsigned long transfer_us;   /* setup and status stage */
+  unsigned long packet_us;     /* each data packet of up to 8 bytes */
+  unsigned long bit_us;        /* one i2c bit per configured us of delay */
+  unsigned long write_us;      /* eeprom write cycle */
+};
+
+void i2c_sim_init(void);
+int i2c_sim_control_msg(int requesttype, int request, int value, int index,
+			char *bytes, int size);
+
+/* add a client, spec is "model[@addr]", e.g. "24c02@0x50" */
+struct i2c_sim_slave *i2c_sim_add(const char *spec);
+void i2c_sim_list_models(FILE *f);
+
+/* select a timing model by name, returns -1 if unknown */
+int i2c_sim_set_timing(const char *name);
+void i2c_sim_list_timings(FILE *f);
+
+/* simulated time passed since i2c_sim_init() in microseconds */
+unsigned long i2c_sim_time(void);
+/* let the simulated time catch up with the real time */
+void i2c_sim_sync(unsigned long now);
+
+extern struct i2c_sim_timing i2c_sim_timing;
+
+#endif
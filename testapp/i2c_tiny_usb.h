@@ -0,0 +1,77 @@
+/*
+ * i2c_tiny_usb.h - protocol definitions shared by the host side tools
+ *                  http://www.harbaum.org/till/i2c_tiny_usb
+ */
+
+#ifndef I2C_TINY_USB_H
+#define I2C_TINY_USB_H
+
+#define I2C_M_RD		0x01
+#define I2C_M_RECV_LEN		0x0400	/* length will be first received byte */
+#define I2C_M_IGNORE_NAK	0x1000	/* data NAKs don't end the message */
+#define I2C_M_NOSTART		0x4000	/* continue without start and address */
+#define I2C_M_MORE		0x0100	/* message continues in the next request */
+
+#define I2C_SMBUS_BLOCK_MAX	32	/* maximum length given by that byte */
+
+/* commands via USB, must e.g. match command ids firmware */
+#define CMD_ECHO           0
+#define CMD_GET_FUNC       1
+#define CMD_SET_DELAY      2
+#define CMD_GET_STATUS     3
+#define CMD_I2C_IO         4
+#define CMD_I2C_BEGIN      1  // flag to I2C_IO
+#define CMD_I2C_END        2  // flag to I2C_IO
+#define CMD_I2C_STATUS     8  // flag to I2C_IO, status appended to IN data
+#define CMD_GET_FEATURES   16
+#define CMD_I2C_XFER_BATCH 17
+#define CMD_I2C_WAIT_ACK   18
+#define CMD_I2C_POLL_REG   19
+#define CMD_I2C_SCAN       20
+#define CMD_I2C_SMBUS      21
+#define CMD_GET_CAPS       22
+#define CMD_SET_STRETCH    23  // wValue: clock stretch timeout in ms
+#define CMD_I2C_RECOVER    24  // line states before, after, clock pulses
+#define CMD_SET_SPEED      25  // wValue: delay of the client in wIndex
+#define CMD_SET_POLL       26  // wValue: poll interval, wIndex: timeout in ms
+
+#define STATUS_IDLE          0
+#define STATUS_ADDRESS_ACK   1
+#define STATUS_ADDRESS_NAK   2
+#define STATUS_PEC_ERROR     3
+#define STATUS_DATA_NAK      4
+#define STATUS_TIMEOUT       5  // a client stretched the clock for too long
+
+/* protocol extensions reported by CMD_GET_FEATURES */
+#define FEATURE_INLINE_STATUS  0x00000001
+#define FEATURE_XFER_BATCH     0x00000002
+#define FEATURE_INT_EP         0x00000004
+#define FEATURE_WAIT_ACK       0x00000008
+#define FEATURE_POLL_REG       0x00000010
+#define FEATURE_SCAN           0x00000020
+#define FEATURE_SMBUS          0x00000040
+#define FEATURE_CHUNK          0x00000080
+#define FEATURE_STRETCH        0x00000100
+#define FEATURE_RECOVER        0x00000200
+#define FEATURE_SPEED          0x00000400
+
+/* line states in the reply of CMD_I2C_RECOVER */
+#define RECOVER_SDA  0x01
+#define RECOVER_SCL  0x02
+
+/* flags of CMD_I2C_SMBUS in the high byte of wValue */
+#define SMBUS_CMD    0x01  // send the command byte
+#define SMBUS_DATA   0x02  // send the data byte
+#define SMBUS_READ   0x04  // read phase
+#define SMBUS_BLOCK  0x08  // the first byte read is the block length
+#define SMBUS_PEC    0x10  // append or check a packet error code
+
+/* CMD_GET_CAPS descriptor, all values little endian, later versions */
+/* only append fields */
+#define CAPS_VERSION 1
+#define CAPS_SIZE    22   // length, version, func, features, 6 shorts
+
+/* smallest batch result buffer of all firmware variants */
+#define BATCH_SIZE 32
+
+#endif
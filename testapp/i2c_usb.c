@@ -41,12 +41,20 @@
 #define CMD_I2C_IO     4
 #define CMD_I2C_BEGIN  1  // flag to I2C_IO
 #define CMD_I2C_END    2  // flag to I2C_IO
+#define CMD_GET_FEATURES 16
+#define CMD_I2C_XFER_BATCH 17
+#define CMD_I2C_POLL_REG 19
+#define CMD_SET_POLL   26
+
+/* protocol extensions reported by CMD_GET_FEATURES */
+#define FEATURE_POLL_REG 0x00000010
 
 #define STATUS_IDLE          0
 #define STATUS_ADDRESS_ACK   1
 #define STATUS_ADDRESS_NAK   2
 
 usb_dev_handle      *handle = NULL;
+unsigned long       features = 0;
 
 /* write a set of bytes to the i2c_tiny_usb device */
 int i2c_tiny_usb_write(int request, int value, int index) {
@@ -105,6 +113,44 @@ int i2c_tiny_usb_get_status(void) {
   return status;
 }
 
+/* get the protocol extensions supported by the firmware */
+void i2c_tiny_usb_get_features(void) {
+  /* older firmware doesn't know the request and returns nothing */
+  if(i2c_tiny_usb_read(CMD_GET_FEATURES, &features, sizeof(features)) == 0)
+    printf("Features = %lx\n", features);
+}
+
+/* let the device read a register until (value & mask) == match, returns */
+/* the value or -1 on error or timeout */
+int i2c_poll_reg(unsigned char addr, unsigned char reg,
+		 unsigned char mask, unsigned char match) {
+  unsigned char result[4];
+
+  /* the device polls for up to the timeout set via CMD_SET_POLL, the */
+  /* result is fetched like that of a batch */
+  if((usb_control_msg(handle, USB_CTRL_OUT, CMD_I2C_POLL_REG,
+		      addr | (reg << 8), mask | (match << 8),
+		      NULL, 0, 1000) < 0) ||
+     (usb_control_msg(handle, USB_CTRL_IN, CMD_I2C_XFER_BATCH, 0, 0,
+		      (char*)result, sizeof(result), 2000) < 4)) {
+    fprintf(stderr, "USB error: %s\n", usb_strerror());
+    return -1;
+  }
+
+  if(result[0] != STATUS_ADDRESS_ACK) {
+    fprintf(stderr, "poll register status failed\n");
+    return -1;
+  }
+
+  if((result[1] & mask) != match) {
+    fprintf(stderr, "poll register timed out after %d reads\n",
+	    result[2] + 256*result[3]);
+    return -1;
+  }
+
+  return result[1];
+}
+
 /* write command and read an 8 or 16 bit value from the given chip */
 int i2c_read_with_cmd(unsigned char addr, char cmd, int length) {
   unsigned char result[2];
@@ -227,6 +273,12 @@ int i2c_write_cmd_and_word(unsigned char addr, char cmd, int data) {
 void ds1621_read_control(void) {
   int result;
 
+  /* the device waits for the done bit itself, saving all the round trips */
+  if(features & FEATURE_POLL_REG) {
+    i2c_poll_reg(DS1621_ADDR, 0xac, 0x80, 0x80);
+    return;
+  }
+
   do {
     result = i2c_read_with_cmd(DS1621_ADDR, 0xac, 1);
   } while(!(result & 0x80));
@@ -290,6 +342,11 @@ int main(int argc, char *argv[]) {
   
   /* do some testing */
   i2c_tiny_usb_get_func();
+  i2c_tiny_usb_get_features();
+
+  /* poll every ms, a ds1621 conversion takes up to 750ms */
+  if(features & FEATURE_POLL_REG)
+    i2c_tiny_usb_write(CMD_SET_POLL, 1, 1000);
 
   /* try to set i2c clock to 100kHz (10us), will actually result in ~50kHz */
   /* since the software generated i2c clock isn't too exact. in fact setting */